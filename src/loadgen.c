@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/*
+ * The loadgen program generates TCP load for benchmarking the encrypting
+ * proxy (mrrcrypt --proxy) and reports connections per second and MB/s.
+ * 
+ * Run it once with -e to start an echo server to use as the proxy
+ * upstream, then again as a client pointed at the proxy:
+ * 
+ *     loadgen -e 127.0.0.1:9001 &
+ *     mrrcrypt -k KEY --proxy 127.0.0.1:9000 127.0.0.1:9001 &
+ *     loadgen -c 1000 -n 65536 -p 16 127.0.0.1:9000
+ * 
+ * The client opens -c connections, sends -n bytes on each, and reads
+ * back the echo. The connections are shared between -p client processes
+ * that each open their connections one after another, so -p connections
+ * are in flight at once. Data that goes through the proxy comes back
+ * decrypted, because the proxy encrypts each direction with a fresh copy
+ * of the same key, so every echo is checked against what was sent.
+ * 
+ * The echo server handles each connection in its own process, so it
+ * never limits how many connections the proxy has open.
+ */
+
+int resolve(char *, struct addrinfo **, int);
+int echo(char *);
+int client(struct addrinfo *, unsigned char *, unsigned char *, int, int);
+int exchange(int, unsigned char *, unsigned char *, int);
+double now(void);
+
+int main(int argc, char *argv[]) {
+	int o, i, n;
+	int count = 100, size = 65536, parallel = 1, failed = 0;
+	int fds[2];
+	char *echoAddress = NULL;
+	double start, elapsed;
+	unsigned char *sent, *received;
+	struct addrinfo *info;
+	
+	// Check arguments
+	while ((o = getopt(argc, argv, "e:c:n:p:")) != -1) {
+		switch (o) {
+			case 'e':
+				echoAddress = optarg;
+				break;
+			case 'c':
+				count = atoi(optarg);
+				break;
+			case 'n':
+				size = atoi(optarg);
+				break;
+			case 'p':
+				parallel = atoi(optarg);
+				break;
+			case '?':
+				if (isprint(optopt))
+					fprintf (stderr, "Unknown option '-%c'.\n", optopt);
+				else
+					fprintf (stderr, "Unknown option character '\\x%x'.\n", optopt);
+				return 1;
+		}
+	}
+	
+	signal(SIGPIPE, SIG_IGN);
+	
+	if (echoAddress != NULL)
+		return echo(echoAddress);
+	
+	if (optind != argc - 1 || count < 1 || size < 0 || parallel < 1 || parallel > count || resolve(argv[optind], &info, 0) == 0) {
+		fprintf(stderr, "Usage: loadgen [-c connections] [-n bytes] [-p parallel] host:port\n");
+		fprintf(stderr, "       loadgen -e host:port\n");
+		return 1;
+	}
+	
+	sent = malloc(size + 1);
+	received = malloc(size + 1);
+	for (i = 0; i < size; ++i)
+		sent[i] = rand();
+	
+	if (pipe(fds) == -1) {
+		fprintf(stderr, "Could not create pipe.\n");
+		return 1;
+	}
+
+	start = now();
+
+	// Start client processes, each reporting its failure count on the pipe
+	for (i = 0; i < parallel; ++i) {
+		if ((n = fork()) == -1) {
+			fprintf(stderr, "Could not start client process.\n");
+			return 1;
+		}
+		if (n == 0) {
+			close(fds[0]);
+			n = client(info, sent, received, size, count / parallel + (i < count % parallel));
+			if (n == -1) {
+				fprintf(stderr, "Could not connect.\n");
+				_exit(1);
+			}
+			if (write(fds[1], &n, sizeof(n)) != sizeof(n))
+				_exit(1);
+			_exit(0);
+		}
+	}
+	close(fds[1]);
+	
+	for (i = 0; i < parallel && read(fds[0], &n, sizeof(n)) == sizeof(n); ++i)
+		failed += n;
+	while (wait(NULL) > 0)
+		;
+	
+	elapsed = now() - start;
+	
+	if (i < parallel)
+		return 1;
+	
+	printf("connections: %d (%d failed), %d in flight\n", count, failed, parallel);
+	printf("bytes:       %d per connection\n", size);
+	printf("elapsed:     %.3f s\n", elapsed);
+	printf("rate:        %.0f connections/s\n", count / elapsed);
+	printf("throughput:  %.2f MB/s\n", (double)count * size / elapsed / 1000000);
+
+	return failed != 0;
+}
+
+int resolve(char *address, struct addrinfo **info, int passive) {
+	int r;
+	char *host, *port;
+	struct addrinfo hints;
+	
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (passive)
+		hints.ai_flags = AI_PASSIVE;
+	
+	if ((port = strrchr(address, ':')) == NULL)
+		return 0;
+	host = strndup(address, port - address);
+	++port;
+	
+	r = getaddrinfo(*host ? host : NULL, port, &hints, info);
+	free(host);
+
+	return r == 0;
+}
+
+int echo(char *address) {
+	int n, r, w, lfd, cfd;
+	int on = 1;
+	unsigned char buffer[65536];
+	struct addrinfo *info;
+	
+	if (resolve(address, &info, 1) == 0
+	    || (lfd = socket(info->ai_family, SOCK_STREAM, 0)) == -1
+	    || setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1
+	    || bind(lfd, info->ai_addr, info->ai_addrlen) == -1
+	    || listen(lfd, SOMAXCONN) == -1) {
+		fprintf(stderr, "Could not listen on %s.\n", address);
+		return 1;
+	}
+	
+	// Finished connection processes are reaped automatically
+	signal(SIGCHLD, SIG_IGN);
+	
+	// Echo each connection in its own process
+	for (;;) {
+		if ((cfd = accept(lfd, NULL, NULL)) == -1)
+			continue;
+		if (fork() == 0) {
+			close(lfd);
+			while ((n = read(cfd, buffer, sizeof(buffer))) > 0) {
+				for (w = 0; w < n; w += r)
+					if ((r = write(cfd, buffer + w, n - w)) <= 0)
+						break;
+				if (w < n)
+					break;
+			}
+			_exit(0);
+		}
+		close(cfd);
+	}
+	
+	return 0;
+}
+
+int client(struct addrinfo *info, unsigned char *sent, unsigned char *received, int size, int count) {
+	int i, fd;
+	int failed = 0;
+	
+	for (i = 0; i < count; ++i) {
+		if ((fd = socket(info->ai_family, SOCK_STREAM, 0)) == -1 || connect(fd, info->ai_addr, info->ai_addrlen) == -1)
+			return -1;
+		if (exchange(fd, sent, received, size) == 0 || memcmp(sent, received, size) != 0)
+			++failed;
+		close(fd);
+	}
+	
+	return failed;
+}
+
+int exchange(int fd, unsigned char *sent, unsigned char *received, int size) {
+	int n;
+	int w = 0, r = 0;
+	struct pollfd pfd;
+	
+	pfd.fd = fd;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	if (size == 0)
+		shutdown(fd, SHUT_WR);
+	
+	// Write and read at the same time so neither side stalls on full buffers
+	while (r < size) {
+		pfd.events = POLLIN | (w < size ? POLLOUT : 0);
+		if (poll(&pfd, 1, -1) == -1)
+			return 0;
+		if ((pfd.revents & POLLOUT) && w < size) {
+			if ((n = write(fd, sent + w, size - w)) == -1 && errno != EAGAIN)
+				return 0;
+			w += n > 0 ? n : 0;
+			if (w == size)
+				shutdown(fd, SHUT_WR);
+		}
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+			if ((n = read(fd, received + r, size - r + 1)) == 0 || (n == -1 && errno != EAGAIN))
+				return 0;
+			r += n > 0 ? n : 0;
+		}
+	}
+	
+	return r == size;
+}
+
+double now(void) {
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
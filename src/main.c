@@ -8,41 +8,152 @@
 #include <stdlib.h>
 #include <unistd.h> 
 #include <ctype.h>
+#include <getopt.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "main.h"
 #include "modules/keyfile.h"
 #include "modules/mirrorfield.h"
 #include "modules/base64.h"
+#include "modules/pcapfile.h"
+#include "modules/proxy.h"
+#include "modules/jsonfield.h"
+#include "modules/profile.h"
+#include "modules/keyscreen.h"
 
 // Function prototypes
 void main_shutdown(const char *);
+static void main_load_key(struct mirrorfield *, char *, int);
+static void main_crypt(struct mirrorfield *, FILE *, FILE *, int);
+static int  main_fanout(char **, char **, int, int);
+static int  main_fanout_feed(int *, int);
+static int  main_genkey(char *, int, int);
+static void main_genkey_stop(int);
+
+/*
+ * Long command options. Each one maps to its short equivalent.
+ */
+static struct option long_options[] = {
+	{"auto-create", no_argument,       NULL, 'a'},
+	{"key",         required_argument, NULL, 'k'},
+	{"version",     no_argument,       NULL, 'v'},
+	{"debug",       required_argument, NULL, 'd'},
+	{"fanout",      no_argument,       NULL, 'f'},
+	{"output",      required_argument, NULL, 'o'},
+	{"pcap",        no_argument,       NULL, 'c'},
+	{"proxy",       required_argument, NULL, 'x'},
+	{"json-paths",  required_argument, NULL, 'j'},
+	{"json-decrypt",no_argument,       NULL, 'J'},
+	{"profile",     required_argument, NULL, 'p'},
+	{"profile-rate",required_argument, NULL, 'r'},
+	{"gen-key",     no_argument,       NULL, 'g'},
+	{"screen",      no_argument,       NULL, 's'},
+	{"count",       required_argument, NULL, 'n'},
+	{NULL, 0, NULL, 0}
+};
+
+/*
+ * Set by main_genkey_stop() when a screening worker receives SIGTERM, so
+ * that it stops after the candidate key it is on.
+ */
+static volatile sig_atomic_t genkeyStop = 0;
 
 /*
  * The main function initializes the modules, checks arguments,
  * validates the key, and reads from STDIN 8 bits at a time. Each 8-bit
  * character is processed through the encryption algorithm and the result
  * is printed to STDOUT.
+ * 
+ * When the fanout flag is set, the input is encrypted once per key given
+ * with -k, and each result is written to the matching -o output file.
+ * When the pcap flag is set, the input is read as a packet capture and
+ * only the packet payloads are encrypted. When the proxy option is set,
+ * TCP connections to the listen address are forwarded to the upstream
+ * address with the data encrypted in both directions. When JSON paths are
+ * given, the input is read as JSON Lines and only the selected string
+ * values are encrypted, or decrypted if the json-decrypt flag is set.
+ * When the gen-key flag is set, new key files are generated instead,
+ * optionally screened for output quality first.
  */
 int main(int argc, char *argv[]) {
-	int o, ch;
+	int o;
 	int autoCreate       = 0;
 	int debug            = 0;
+	int fanout           = 0;
+	int pcap             = 0;
+	int json             = 0;
+	int jsonDecrypt      = 0;
+	int genKey           = 0;
+	int screen           = 0;
+	int genCount         = 0;
+	int profileRate      = PROFILE_DEFAULT_RATE;
+	int profileRateSet   = 0;
+	int keyCount         = 0;
+	int outputCount      = 0;
 	char *version        = VERSION;
 	char *keyFileName    = DEFAULT_KEY_NAME;
-	unsigned char l, r;
+	char *proxyListen    = NULL;
+	char *profileFile    = NULL;
+	char **keyFileNames  = malloc(argc * sizeof(char *));
+	char **outputNames   = malloc(argc * sizeof(char *));
+	struct mirrorfield mf;
 	
 	// Run module init functions
 	keyfile_init();
-	mirrorfield_init();
 
 	// Check arguments
-	while ((o = getopt(argc, argv, "ak:vd:")) != -1) {
+	while ((o = getopt_long(argc, argv, "ak:vd:fo:cx:j:Jp:r:gsn:", long_options, NULL)) != -1) {
 		switch (o) {
 			case 'a':
 				autoCreate = 1;
 				break;
 			case 'k':
 				keyFileName = optarg;
+				keyFileNames[keyCount++] = optarg;
+				break;
+			case 'f':
+				fanout = 1;
+				break;
+			case 'o':
+				outputNames[outputCount++] = optarg;
+				break;
+			case 'c':
+				pcap = 1;
+				break;
+			case 'x':
+				proxyListen = optarg;
+				break;
+			case 'j':
+				if (jsonfield_paths(optarg) == 0)
+					main_shutdown("Invalid JSON path. Paths look like $.user.email");
+				json = 1;
+				break;
+			case 'J':
+				jsonDecrypt = 1;
+				break;
+			case 'p':
+				profileFile = optarg;
+				break;
+			case 'r':
+				profileRate = atoi(optarg);
+				profileRateSet = 1;
+				break;
+			case 'g':
+				genKey = 1;
+				break;
+			case 's':
+				screen = 1;
+				break;
+			case 'n':
+				genCount = atoi(optarg);
+				if (genCount < 1)
+					main_shutdown("The --count option requires a positive number.");
 				break;
 			case 'v':
 				printf("mrrcrypt version %s\n", version);
@@ -59,6 +170,77 @@ int main(int argc, char *argv[]) {
 		}
 	}
 	
+	// Start sampling profiler
+	if (profileRateSet && profileFile == NULL)
+		main_shutdown("The --profile-rate option requires --profile.");
+	if (profileFile != NULL && profile_start(profileFile, profileRate) == 0)
+		main_shutdown("Could not start profiler.");
+	
+	// Generate new key files
+	if (genKey)
+		return main_genkey(keyFileName, genCount > 0 ? genCount : 1, screen);
+	
+	if (screen || genCount > 0)
+		main_shutdown("The --screen and --count options require --gen-key.");
+
+	// Fan out to one worker per key
+	if (fanout) {
+		if (keyCount == 0 || keyCount != outputCount)
+			main_shutdown("Fan-out requires one -o output for each -k key.");
+
+		return main_fanout(keyFileNames, outputNames, keyCount, autoCreate);
+	}
+	
+	if (outputCount > 0)
+		main_shutdown("The -o option requires --fanout.");
+	
+	if (jsonDecrypt && !json)
+		main_shutdown("The --json-decrypt option requires --json-paths.");
+
+	// Load key
+	main_load_key(&mf, keyFileName, autoCreate);
+
+	// Proxy TCP connections to the upstream address
+	if (proxyListen != NULL) {
+		if (optind != argc - 1)
+			main_shutdown("The --proxy option requires one upstream address.");
+		proxy_run(proxyListen, argv[optind], &mf);
+		main_shutdown("Could not start proxy. Check addresses.");
+	}
+
+	// Encrypt packet payloads of a capture on STDIN to STDOUT
+	if (pcap) {
+		if (pcapfile_crypt(stdin, stdout, &mf, sysconf(_SC_NPROCESSORS_ONLN)) == 0)
+			main_shutdown("Invalid or truncated capture file.");
+		return 0;
+	}
+
+	// Encrypt selected values of JSON Lines on STDIN to STDOUT
+	if (json) {
+		if (jsonfield_crypt(stdin, stdout, &mf, jsonDecrypt, sysconf(_SC_NPROCESSORS_ONLN)) == 0)
+			main_shutdown("Could not process JSON input.");
+		return 0;
+	}
+
+	// Encrypt STDIN to STDOUT
+	main_crypt(&mf, stdin, stdout, debug);
+
+	return 0;
+}
+
+/*
+ * The main_load_key() function opens the named key file, loads its
+ * contents in to the given mirror field, and validates and links the
+ * field. The program is shut down if any of these steps fail.
+ */
+static void main_load_key(struct mirrorfield *mf, char *keyFileName, int autoCreate) {
+	int ch;
+
+	PROFILE_PUSH(PROFILE_KEY_LOAD);
+
+	// Prepare an empty mirror field
+	mirrorfield_init(mf);
+
 	// Turn on autoCreate flag for default key file
 	if (strcmp(DEFAULT_KEY_NAME, keyFileName) == 0)
 		autoCreate = 1;
@@ -73,38 +255,259 @@ int main(int argc, char *argv[]) {
 
 	// Read key file and build mirror field
 	while ((ch = keyfile_next_char()) != EOF)
-		if ((mirrorfield_set((unsigned char)ch)) == 0)
+		if ((mirrorfield_set(mf, (unsigned char)ch)) == 0)
 			break;
 
 	// Close key file
 	keyfile_close();
 	
 	// Validate mirror field contents
-	if (mirrorfield_validate() == 0)
+	if (mirrorfield_validate(mf) == 0)
 		main_shutdown("Key file error. Invalid content.");
 
 	// Create grid links
-	mirrorfield_link();
+	mirrorfield_link(mf);
+	
+	PROFILE_POP();
+}
 
-	// Loop over input one char at a time and encrypt
-	while ((ch = getchar()) != EOF) {
-		
-		// Crypt right 4 bits
-		r = (ch & 0x0F);
-		r = mirrorfield_crypt_char(r, debug);
+/*
+ * The main_crypt() function reads from the input stream 8 bits at a time
+ * and writes each encrypted character to the output stream.
+ */
+static void main_crypt(struct mirrorfield *mf, FILE *in, FILE *out, int debug) {
+	int ch;
+
+	// Loop over input one char at a time, encrypt, and print
+	for (;;) {
+		PROFILE_PUSH(PROFILE_READ);
+		ch = getc(in);
+		PROFILE_POP();
 		
-		// Get left 4 bits
-		l = (ch >> 4);
-		l = mirrorfield_crypt_char(l, debug);
+		if (ch == EOF)
+			break;
 		
-		// Assemble right and left results back into a byte
-		ch = (l << 4) + r;
+		PROFILE_PUSH(PROFILE_CRYPT);
+		ch = mirrorfield_crypt_byte(mf, ch, debug);
+		PROFILE_POP();
 		
-		// Print char
-		putchar(ch);
+		PROFILE_PUSH(PROFILE_WRITE);
+		putc(ch, out);
+		PROFILE_POP();
 	}
+}
 
-	return 0;
+/*
+ * The main_fanout() function starts one worker process per key. Each
+ * worker loads its own key and encrypts the data it receives on a pipe
+ * to its output file. STDIN is read only once and fed to every worker's
+ * pipe by main_fanout_feed().
+ * The workers run concurrently, so the cipher work for each key is spread
+ * across the available cores.
+ * 
+ * Returns zero if all workers succeeded, non-zero otherwise.
+ */
+static int main_fanout(char **keyFileNames, char **outputNames, int count, int autoCreate) {
+	int i, j, status;
+	int failed = 0;
+	int fds[2];
+	int *pipes = malloc(count * sizeof(int));
+	pid_t *pids = malloc(count * sizeof(pid_t));
+	struct mirrorfield mf;
+	FILE *in, *out;
+	
+	// A worker that exits early must not kill the parent
+	signal(SIGPIPE, SIG_IGN);
+
+	// Start workers
+	for (i = 0; i < count; ++i) {
+		if (pipe(fds) == -1)
+			main_shutdown("Could not create fan-out pipe.");
+
+		if ((pids[i] = fork()) == -1)
+			main_shutdown("Could not start fan-out worker.");
+
+		if (pids[i] == 0) {
+			profile_fork();
+
+			// Close write ends held for the previous workers and ourself
+			for (j = 0; j < i; ++j)
+				close(pipes[j]);
+			close(fds[1]);
+			
+			// Load this worker's key and open its output
+			main_load_key(&mf, keyFileNames[i], autoCreate);
+			if ((out = fopen(outputNames[i], "w")) == NULL)
+				main_shutdown("Could not open output file.");
+			in = fdopen(fds[0], "r");
+			
+			main_crypt(&mf, in, out, 0);
+			
+			fclose(in);
+			if (fclose(out) != 0)
+				main_shutdown("Could not write output file.");
+			exit(0);
+		}
+
+		close(fds[0]);
+		pipes[i] = fds[1];
+		fcntl(pipes[i], F_SETFL, fcntl(pipes[i], F_GETFL) | O_NONBLOCK);
+	}
+	
+	// Read input once and hand it to every worker
+	if (main_fanout_feed(pipes, count) == 0) {
+		fprintf(stderr, "Could not read input for fan-out workers.\n");
+		failed = 1;
+	}
+	
+	// Signal EOF to workers and wait for them to finish
+	for (i = 0; i < count; ++i)
+		if (pipes[i] != -1)
+			close(pipes[i]);
+
+	for (i = 0; i < count; ++i) {
+		if (waitpid(pids[i], &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "Fan-out worker for key '%s' failed.\n", keyFileNames[i]);
+			failed = 1;
+		}
+	}
+	
+	free(pids);
+	free(pipes);
+
+	return failed;
+}
+
+/*
+ * The main_genkey() function generates count new key files. A single key
+ * is written to the named key file. When count is more than one, the keys
+ * are written to the name with a numbered suffix: name.1, name.2, etc.
+ * Existing key files are never overwritten, since keyfile_write() only
+ * creates new files.
+ * 
+ * When screen is set, candidate keys are checked with keyscreen_check()
+ * and only those that pass are written. One worker process per online
+ * CPU generates and screens candidates, sending each key that passes to
+ * the parent on a shared pipe. A key is smaller than PIPE_BUF, so keys
+ * from different workers never interleave. The parent writes key files
+ * until it has enough and then stops the workers. The workers give up
+ * after screening KEYSCREEN_MAX_TRIES candidates for each key needed
+ * between them, so thresholds that reject every key can not hang.
+ * 
+ * Returns zero if all key files were written, non-zero otherwise.
+ */
+static int main_genkey(char *keyFileName, int count, int screen) {
+	int i, n, r, workers, tries;
+	int fds[2];
+	char *name;
+	char **paths = malloc(count * sizeof(char *));
+	pid_t *pids = NULL;
+	struct stat sb;
+	unsigned char key[KEYFILE_KEY_SIZE];
+	
+	// Determine key file paths, refusing early if any exist
+	for (i = 0; i < count; ++i) {
+		name = keyFileName;
+		if (count > 1) {
+			name = malloc(strlen(keyFileName) + 12);
+			sprintf(name, "%s.%d", keyFileName, i + 1);
+		}
+		if ((paths[i] = keyfile_path(name)) == NULL)
+			main_shutdown("Could not determine key file path. Check $HOME.");
+		if (stat(paths[i], &sb) == 0) {
+			fprintf(stderr, "Key file '%s' already exists.\n", paths[i]);
+			main_shutdown("Refusing to overwrite key file.");
+		}
+	}
+	
+	// Generate without screening
+	if (!screen) {
+		for (i = 0; i < count; ++i) {
+			if (keyfile_generate(key) == 0 || keyfile_write(paths[i], key) == 0) {
+				if (errno == EEXIST)
+					main_shutdown("Refusing to overwrite key file.");
+				main_shutdown("Could not create key file. Check permissions.");
+			}
+			printf("%s\n", paths[i]);
+		}
+		free(paths);
+		return 0;
+	}
+	
+	// Start one screening worker per online CPU
+	if ((workers = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		workers = 1;
+	pids = malloc(workers * sizeof(pid_t));
+	tries = ((long)count * KEYSCREEN_MAX_TRIES + workers - 1) / workers;
+
+	if (pipe(fds) == -1)
+		main_shutdown("Could not create screening pipe.");
+
+	for (i = 0; i < workers; ++i) {
+		if ((pids[i] = fork()) == -1)
+			main_shutdown("Could not start screening worker.");
+
+		if (pids[i] == 0) {
+			profile_fork();
+			signal(SIGTERM, main_genkey_stop);
+			signal(SIGPIPE, SIG_IGN);
+			close(fds[0]);
+			for (n = 0; n < tries && !genkeyStop; ++n) {
+				if (keyfile_generate(key) == 0)
+					exit(1);
+				if (keyscreen_check(key) == 0)
+					continue;
+				if (write(fds[1], key, KEYFILE_KEY_SIZE) != KEYFILE_KEY_SIZE)
+					break;
+			}
+			exit(0);
+		}
+	}
+	close(fds[1]);
+	
+	// Write each key that passes to the next key file
+	for (i = 0; i < count; ++i) {
+		for (n = 0; n < KEYFILE_KEY_SIZE; n += r) {
+			if ((r = read(fds[0], key + n, KEYFILE_KEY_SIZE - n)) == -1 && errno == EINTR)
+				r = 0;
+			else if (r <= 0)
+				break;
+		}
+		if (n < KEYFILE_KEY_SIZE) {
+			fprintf(stderr, "Too many candidate keys failed screening. Stopped after %d key(s).\n", i);
+			break;
+		}
+		if (keyfile_write(paths[i], key) == 0) {
+			if (errno == EEXIST)
+				fprintf(stderr, "Key file '%s' already exists.\n", paths[i]);
+			else
+				fprintf(stderr, "Could not create key file '%s'. Check permissions.\n", paths[i]);
+			break;
+		}
+		printf("%s\n", paths[i]);
+	}
+	
+	// Stop workers
+	close(fds[0]);
+	for (n = 0; n < workers; ++n)
+		kill(pids[n], SIGTERM);
+	for (n = 0; n < workers; ++n)
+		waitpid(pids[n], NULL, 0);
+	
+	free(pids);
+	free(paths);
+
+	return i < count;
+}
+
+/*
+ * The main_genkey_stop() function is the SIGTERM handler of a screening
+ * worker. The worker finishes the candidate it is on and exits normally,
+ * so that its profile is written if the profiler is running.
+ */
+static void main_genkey_stop(int sig) {
+	(void)sig;
+	genkeyStop = 1;
 }
 
 /*
@@ -122,3 +525,107 @@ void main_shutdown(const char *errmsg) {
 	// Shutdown
 	exit(1);
 }
+
+/*
+ * The main_fanout_feed() function reads STDIN in blocks of
+ * FANOUT_BLOCK_SIZE in to a ring of FANOUT_QUEUE_BLOCKS blocks and writes
+ * every block to the pipe of every fan-out worker. Each worker has its
+ * own position in the ring, so a fast worker can run ahead of a slow one
+ * by up to FANOUT_QUEUE_BLOCKS blocks. Input is only read when the
+ * slowest worker has finished with the oldest block. The pipe of a worker
+ * that has exited is closed and set to -1.
+ * 
+ * Returns zero if STDIN could not be read, non-zero otherwise.
+ */
+static int main_fanout_feed(int *pipes, int count) {
+	int i, k, n, p, slot;
+	int eof = 0;
+	int ok = 1;
+	long head = 0;
+	long tail;
+	long *next = calloc(count, sizeof(long));
+	int *sent = calloc(count, sizeof(int));
+	int *owner = malloc((count + 1) * sizeof(int));
+	int lengths[FANOUT_QUEUE_BLOCKS];
+	unsigned char *ring = malloc((size_t)FANOUT_QUEUE_BLOCKS * FANOUT_BLOCK_SIZE);
+	struct pollfd *pfds = malloc((count + 1) * sizeof(struct pollfd));
+
+	for (;;) {
+
+		// Wait on every pipe that is behind and on STDIN if the ring has room
+		tail = head;
+		for (i = 0, p = 0; i < count; ++i) {
+			if (pipes[i] == -1)
+				continue;
+			if (next[i] < tail)
+				tail = next[i];
+			if (next[i] < head) {
+				pfds[p].fd = pipes[i];
+				pfds[p].events = POLLOUT;
+				owner[p++] = i;
+			}
+		}
+		if (!eof && head - tail < FANOUT_QUEUE_BLOCKS) {
+			pfds[p].fd = STDIN_FILENO;
+			pfds[p].events = POLLIN;
+			owner[p++] = -1;
+		}
+		
+		// Done when input is exhausted and every worker has all of it
+		if (p == 0)
+			break;
+
+		if (poll(pfds, p, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			ok = 0;
+			break;
+		}
+		
+		for (k = 0; k < p; ++k) {
+			if (pfds[k].revents == 0)
+				continue;
+
+			// Read the next block in to the ring
+			if (owner[k] == -1) {
+				slot = head % FANOUT_QUEUE_BLOCKS;
+				if ((n = read(STDIN_FILENO, ring + (size_t)slot * FANOUT_BLOCK_SIZE, FANOUT_BLOCK_SIZE)) == -1) {
+					if (errno == EINTR || errno == EAGAIN)
+						continue;
+					ok = 0;
+					eof = 1;
+				} else if (n == 0) {
+					eof = 1;
+				} else {
+					lengths[slot] = n;
+					++head;
+				}
+				continue;
+			}
+			
+			// Write as much of the worker's current block as the pipe takes
+			i = owner[k];
+			slot = next[i] % FANOUT_QUEUE_BLOCKS;
+			if ((n = write(pipes[i], ring + (size_t)slot * FANOUT_BLOCK_SIZE + sent[i], lengths[slot] - sent[i])) == -1) {
+				if (errno == EAGAIN || errno == EINTR)
+					continue;
+				close(pipes[i]);
+				pipes[i] = -1;
+				continue;
+			}
+			sent[i] += n;
+			if (sent[i] == lengths[slot]) {
+				sent[i] = 0;
+				++next[i];
+			}
+		}
+	}
+	
+	free(pfds);
+	free(ring);
+	free(owner);
+	free(sent);
+	free(next);
+
+	return ok;
+}
@@ -37,4 +37,16 @@
  */
 #define MIRROR_FIELD_COUNT     5
 
+/*
+ * Size in bytes of the blocks that are read from STDIN and handed to each
+ * worker when the --fanout option is used.
+ */
+#define FANOUT_BLOCK_SIZE      65536
+
+/*
+ * Number of input blocks held for the fan-out workers. A fast worker can
+ * run this many blocks ahead of the slowest worker.
+ */
+#define FANOUT_QUEUE_BLOCKS    16
+
 #endif
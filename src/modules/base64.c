@@ -7,6 +7,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include "modules/base64.h"
+#include "modules/profile.h"
 
 /*
  * MODULE DESCRIPTION
@@ -62,6 +63,8 @@ base64 base64_encode(base64 data) {
 	uint32_t octet_1, octet_2, octet_3;
 	uint32_t combined = 0;
 	
+	PROFILE_PUSH(PROFILE_BASE64);
+	
 	// Assigning octets
 	octet_1 = data.index >= 1 ? data.decoded[0] : 0;
 	octet_2 = data.index >= 2 ? data.decoded[1] : 0;
@@ -84,6 +87,8 @@ base64 base64_encode(base64 data) {
 		data.encoded[3] = '=';
 	}
 	
+	PROFILE_POP();
+	
 	return data;
 }
 
@@ -98,6 +103,8 @@ base64 base64_decode(base64 data) {
 	uint32_t octet_1, octet_2, octet_3, octet_4;
 	uint32_t combined = 0;
 	
+	PROFILE_PUSH(PROFILE_BASE64);
+	
 	// Change encoded chars to decimal index in encoding_table
 	for (i = 0; i < 64; ++i)
 		if (data.encoded[0] == encoding_table[i]) {
@@ -135,6 +142,7 @@ base64 base64_decode(base64 data) {
 	// Verify all input chars were found, return with error if not
 	if (f < 4) {
 		data.error = 1;
+		PROFILE_POP();
 		return data;
 	}
 	
@@ -151,5 +159,7 @@ base64 base64_decode(base64 data) {
 	data.decoded[1] = (combined >> 8) & 0xFF;
 	data.decoded[2] = (combined >> 0) & 0xFF;
 	
+	PROFILE_POP();
+	
 	return data;
 }
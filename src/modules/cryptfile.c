@@ -0,0 +1,219 @@
+// Copyright (c) 2017 Brian Barto
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GPL License. See LICENSE for more details.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "main.h"
+#include "modules/mirrorfield.h"
+#include "modules/cryptfile.h"
+
+/*
+ * MODULE DESCRIPTION
+ * 
+ * The cryptfile module provides random access reads of decrypted data
+ * from an encrypted file. Because the mirror field state at any offset
+ * depends on every byte before it, the file is decrypted in blocks of
+ * CRYPTFILE_BLOCK_SIZE and the packed mirror field state at the start of
+ * each block is kept as a checkpoint. Checkpoints are recorded the first
+ * time the blocks before them are decrypted, so a read only needs to
+ * decrypt from the nearest checkpoint. Recently decrypted blocks are kept
+ * in a least recently used cache, so repeated reads of the same region
+ * are served without decrypting again.
+ */
+
+// Static Function Prototypes
+static struct cryptfile_block *cryptfile_block_get(struct cryptfile *, long);
+static struct cryptfile_block *cryptfile_block_decrypt(struct cryptfile *, long);
+
+/*
+ * The cryptfile_open() function opens the encrypted file at path for
+ * reading with the given key. The key must be loaded, validated, and
+ * linked, and is not modified.
+ * 
+ * Upon any errors, NULL is returned.
+ */
+struct cryptfile *cryptfile_open(char *path, const struct mirrorfield *key) {
+	int i;
+	struct stat sb;
+	struct cryptfile *h;
+	
+	if ((h = malloc(sizeof(struct cryptfile))) == NULL)
+		return NULL;
+
+	// Open file and get its size
+	if ((h->fd = open(path, O_RDONLY)) == -1) {
+		free(h);
+		return NULL;
+	}
+	if (fstat(h->fd, &sb) == -1) {
+		close(h->fd);
+		free(h);
+		return NULL;
+	}
+	h->size = sb.st_size;
+	
+	// Allocate checkpoints. The key itself is the checkpoint for block 0.
+	h->checkpoints = malloc(((h->size / CRYPTFILE_BLOCK_SIZE) + 1) * MIRRORFIELD_PACKED_SIZE);
+	if (h->checkpoints == NULL) {
+		close(h->fd);
+		free(h);
+		return NULL;
+	}
+	mirrorfield_pack(key, h->checkpoints);
+	h->checkpointCount = 1;
+	
+	// Empty the cache
+	h->tick = 0;
+	for (i = 0; i < CRYPTFILE_CACHE_BLOCKS; ++i) {
+		h->cache[i].index = -1;
+		h->cache[i].length = 0;
+		h->cache[i].used = 0;
+	}
+	
+	return h;
+}
+
+/*
+ * The cryptfile_pread() function decrypts up to len bytes from the file,
+ * starting at offset off, in to buf.
+ * 
+ * Returns the number of bytes read, which is zero at the end of the file,
+ * or -1 upon any errors. If the file has shrunk since it was opened, the
+ * read stops short at the new end of the file.
+ */
+long cryptfile_pread(struct cryptfile *h, unsigned char *buf, long len, long off) {
+	long n, start;
+	long count = 0;
+	struct cryptfile_block *block;
+	
+	if (off < 0 || len < 0)
+		return -1;
+	
+	// Clamp read to end of file
+	if (off >= h->size)
+		return 0;
+	if (len > h->size - off)
+		len = h->size - off;
+	
+	// Copy from each block the read overlaps
+	while (count < len) {
+		if ((block = cryptfile_block_get(h, (off + count) / CRYPTFILE_BLOCK_SIZE)) == NULL)
+			return -1;
+
+		// Stop at the end of a block cut short by the file shrinking
+		start = (off + count) % CRYPTFILE_BLOCK_SIZE;
+		if ((n = block->length - start) <= 0)
+			break;
+		if (n > len - count)
+			n = len - count;
+		
+		memcpy(buf + count, block->data + start, n);
+		count += n;
+	}
+	
+	return count;
+}
+
+/*
+ * The cryptfile_close() function closes the file and frees the handle.
+ */
+void cryptfile_close(struct cryptfile *h) {
+	close(h->fd);
+	free(h->checkpoints);
+	free(h);
+}
+
+/*
+ * The cryptfile_block_get() function returns the decrypted block with
+ * the given index, from the cache if possible. If there is no checkpoint
+ * for the block yet, the blocks between the last checkpoint and this one
+ * are decrypted first to record their checkpoints.
+ * 
+ * Upon any errors, NULL is returned. This includes a block that cannot
+ * be reached because an earlier block was cut short by the file
+ * shrinking.
+ */
+static struct cryptfile_block *cryptfile_block_get(struct cryptfile *h, long index) {
+	int i;
+	long count;
+	
+	// Check the cache
+	for (i = 0; i < CRYPTFILE_CACHE_BLOCKS; ++i) {
+		if (h->cache[i].index == index) {
+			h->cache[i].used = ++h->tick;
+			return &h->cache[i];
+		}
+	}
+	
+	// Decrypt forward to record the checkpoint for the block
+	while ((count = h->checkpointCount) <= index)
+		if (cryptfile_block_decrypt(h, count - 1) == NULL || h->checkpointCount == count)
+			return NULL;
+
+	return cryptfile_block_decrypt(h, index);
+}
+
+/*
+ * The cryptfile_block_decrypt() function decrypts the block with the
+ * given index from its checkpoint and stores it in the least recently
+ * used cache slot. If the checkpoint for the following block has not been
+ * recorded yet, it is recorded here. Only the part of the block within
+ * the size of the file when it was opened is read.
+ * 
+ * Upon any errors, NULL is returned.
+ */
+static struct cryptfile_block *cryptfile_block_decrypt(struct cryptfile *h, long index) {
+	int i;
+	long n, r, length;
+	struct cryptfile_block *block = &h->cache[0];
+	struct mirrorfield mf;
+	
+	// Find the least recently used slot
+	for (i = 1; i < CRYPTFILE_CACHE_BLOCKS; ++i)
+		if (h->cache[i].used < block->used)
+			block = &h->cache[i];
+	
+	// Restore the mirror field from the block checkpoint
+	if (mirrorfield_unpack(&mf, h->checkpoints + (index * MIRRORFIELD_PACKED_SIZE)) == 0)
+		return NULL;
+	
+	// Read the encrypted block, ignoring anything appended since the file
+	// was opened so checkpoints stay within the size they were allocated for
+	length = h->size - (index * CRYPTFILE_BLOCK_SIZE);
+	if (length > CRYPTFILE_BLOCK_SIZE)
+		length = CRYPTFILE_BLOCK_SIZE;
+	block->index = -1;
+	for (n = 0; n < length; n += r) {
+		r = pread(h->fd, block->data + n, length - n, (index * CRYPTFILE_BLOCK_SIZE) + n);
+		if (r == -1 && errno == EINTR)
+			r = 0;
+		else if (r == -1)
+			return NULL;
+		else if (r == 0)
+			break;
+	}
+
+	// Decrypt it
+	for (i = 0; i < n; ++i)
+		block->data[i] = mirrorfield_crypt_byte(&mf, block->data[i], 0);
+	
+	block->index = index;
+	block->length = n;
+	block->used = ++h->tick;
+	
+	// Record the next checkpoint
+	if (index + 1 == h->checkpointCount && n == CRYPTFILE_BLOCK_SIZE) {
+		mirrorfield_pack(&mf, h->checkpoints + (h->checkpointCount * MIRRORFIELD_PACKED_SIZE));
+		++h->checkpointCount;
+	}
+	
+	return block;
+}
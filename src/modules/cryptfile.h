@@ -0,0 +1,51 @@
+// Copyright (c) 2017 Brian Barto
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GPL License. See LICENSE for more details.
+
+#ifndef CRYPTFILE_H
+#define CRYPTFILE_H 1
+
+#include "modules/mirrorfield.h"
+
+/*
+ * Size in bytes of the blocks that are decrypted and cached. A mirror
+ * field checkpoint is kept at the start of every block.
+ */
+#define CRYPTFILE_BLOCK_SIZE   4096
+
+/*
+ * Number of decrypted blocks kept in the cache.
+ */
+#define CRYPTFILE_CACHE_BLOCKS 64
+
+/*
+ * Cached Block Definition
+ */
+struct cryptfile_block {
+	long index;
+	long length;
+	unsigned long used;
+	unsigned char data[CRYPTFILE_BLOCK_SIZE];
+};
+
+/*
+ * Encrypted File Handle Definition
+ */
+struct cryptfile {
+	int fd;
+	long size;
+	long checkpointCount;
+	unsigned long tick;
+	unsigned char *checkpoints;
+	struct cryptfile_block cache[CRYPTFILE_CACHE_BLOCKS];
+};
+
+/*
+ * Function Prototypes
+ */
+struct cryptfile *cryptfile_open(char *, const struct mirrorfield *);
+long  cryptfile_pread(struct cryptfile *, unsigned char *, long, long);
+void  cryptfile_close(struct cryptfile *);
+
+#endif
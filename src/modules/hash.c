@@ -0,0 +1,29 @@
+// Copyright (c) 2017 Brian Barto
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GPL License. See LICENSE for more details.
+
+#include <stddef.h>
+#include <stdint.h>
+#include "modules/hash.h"
+
+/*
+ * MODULE DESCRIPTION
+ * 
+ * The hash module provides the hash function shared by the hash tables
+ * of the other modules. It is not meant to resist deliberate collisions.
+ */
+
+/*
+ * The hash_fnv1a() function returns the 32 bit FNV-1a hash of length
+ * bytes at data.
+ */
+uint32_t hash_fnv1a(const void *data, size_t length) {
+	size_t i;
+	uint32_t hash = 2166136261u;
+	
+	for (i = 0; i < length; ++i)
+		hash = (hash ^ ((const unsigned char *)data)[i]) * 16777619u;
+	
+	return hash;
+}
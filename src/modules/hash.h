@@ -0,0 +1,17 @@
+// Copyright (c) 2017 Brian Barto
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GPL License. See LICENSE for more details.
+
+#ifndef HASH_H
+#define HASH_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Function Prototypes
+ */
+uint32_t hash_fnv1a(const void *, size_t);
+
+#endif
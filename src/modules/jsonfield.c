@@ -0,0 +1,607 @@
+// Copyright (c) 2017 Brian Barto
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GPL License. See LICENSE for more details.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+
+#include "main.h"
+#include "modules/mirrorfield.h"
+#include "modules/workers.h"
+#include "modules/base64.h"
+#include "modules/jsonfield.h"
+
+/*
+ * MODULE DESCRIPTION
+ * 
+ * The jsonfield module encrypts selected string values in JSON Lines
+ * input, one document per line, and leaves the rest of each document
+ * untouched. Values are selected with simple paths of object keys, such
+ * as $.user.email, set with jsonfield_paths().
+ * 
+ * Each selected value is encrypted with a fresh mirror field cloned from
+ * the key, then base64 armored and marked with JSONFIELD_PREFIX, so it
+ * stays a valid JSON string. The direction is always given by the
+ * caller and never guessed from a value. When decrypting, only values
+ * that carry the prefix are decrypted, and a result that is not valid
+ * JSON string text is discarded and the value left unchanged.
+ * 
+ * Every value is encrypted independently, so lines can be processed in
+ * any order. With more than one worker, lines are read in to a batch
+ * buffer shared with worker processes, each worker processes a run of
+ * whole lines and sends its output back, and the outputs are written in
+ * input order.
+ * 
+ * Documents are not fully parsed. A structural scan tracks only nesting,
+ * object keys, and string boundaries. String contents are skipped with
+ * memchr(), which the C library implements with vector instructions, so
+ * most of each line is never looked at byte by byte.
+ */
+
+/*
+ * Path and Scanner Definitions
+ */
+struct jsonpath {
+	int count;
+	char **keys;
+	size_t *lengths;
+};
+
+struct jsonframe {
+	int object;
+	int expectKey;
+	char *key;
+	size_t keyLength;
+};
+
+// Static Variables
+static struct jsonpath *paths;
+static int pathCount;
+static const struct mirrorfield *template;
+static int decrypt;
+static char *batch;
+static struct workers pool;
+
+// Static Function Prototypes
+static void  jsonfield_worker(int, int, int);
+static int   jsonfield_flush(size_t, FILE *);
+static int   jsonfield_collect(char **, size_t *);
+static void  jsonfield_lines(char *, size_t, FILE *);
+static void  jsonfield_line(char *, size_t, FILE *);
+static char *jsonfield_string_end(char *, char *);
+static int   jsonfield_match(struct jsonframe *, int);
+static void  jsonfield_value(char *, size_t, FILE *);
+static void  jsonfield_decrypt(char *, size_t, FILE *);
+static int   jsonfield_valid(const unsigned char *, size_t);
+
+/*
+ * The jsonfield_paths() function sets the paths of the values to encrypt
+ * from a comma separated list such as "$.user.email,$.card".
+ * 
+ * Zero is returned if any path is invalid.
+ */
+int jsonfield_paths(char *spec) {
+	char *path, *key, *saved;
+	struct jsonpath *p;
+	
+	spec = strdup(spec);
+	
+	for (path = strtok_r(spec, ",", &saved); path != NULL; path = strtok_r(NULL, ",", &saved)) {
+		if (strncmp(path, "$.", 2) != 0)
+			return 0;
+
+		paths = realloc(paths, (pathCount + 1) * sizeof(struct jsonpath));
+		p = &paths[pathCount++];
+		p->count = 0;
+		p->keys = NULL;
+		p->lengths = NULL;
+		
+		// Split the path in to keys
+		for (key = path + 2; ; key = strchr(key, '.') + 1) {
+			p->keys = realloc(p->keys, (p->count + 1) * sizeof(char *));
+			p->lengths = realloc(p->lengths, (p->count + 1) * sizeof(size_t));
+			p->keys[p->count] = key;
+			p->lengths[p->count] = strchr(key, '.') ? (size_t)(strchr(key, '.') - key) : strlen(key);
+			if (p->lengths[p->count++] == 0 || p->count > JSONFIELD_MAX_DEPTH)
+				return 0;
+			if (strchr(key, '.') == NULL)
+				break;
+		}
+	}
+	
+	return pathCount > 0;
+}
+
+/*
+ * The jsonfield_crypt() function reads JSON Lines from in and writes
+ * them to out with the selected values encrypted, or decrypted if the
+ * decrypt flag is set. Up to the given number of worker processes share
+ * the work. One or fewer processes every line in this process.
+ * 
+ * Zero is returned if the workers can not be started or fail, or if
+ * writing fails.
+ */
+int jsonfield_crypt(FILE *in, FILE *out, const struct mirrorfield *key, int direction, int workers) {
+	int r = 1;
+	char *line = NULL;
+	size_t size = 0;
+	size_t used = 0;
+	ssize_t length;
+	
+	template = key;
+	decrypt = direction;
+	
+	if (workers > WORKERS_MAX)
+		workers = WORKERS_MAX;
+	
+	// Process each line in this process
+	if (workers < 2) {
+		while ((length = getline(&line, &size, in)) != -1)
+			jsonfield_line(line, length, out);
+		free(line);
+		return fflush(out) == 0;
+	}
+	
+	// Create batch buffer, shared with workers
+	batch = mmap(NULL, JSONFIELD_BATCH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (batch == MAP_FAILED)
+		return 0;
+	if (workers_start(&pool, workers, jsonfield_worker) == 0) {
+		munmap(batch, JSONFIELD_BATCH_SIZE);
+		return 0;
+	}
+	
+	// Collect lines in to batches. A line too long for a batch is
+	// processed here, after the batch before it.
+	while (r && (length = getline(&line, &size, in)) != -1) {
+		if (used + length > JSONFIELD_BATCH_SIZE) {
+			r = jsonfield_flush(used, out);
+			used = 0;
+		}
+		if (length > JSONFIELD_BATCH_SIZE) {
+			jsonfield_line(line, length, out);
+		} else {
+			memcpy(batch + used, line, length);
+			used += length;
+		}
+	}
+	if (r && used > 0)
+		r = jsonfield_flush(used, out);
+	
+	workers_stop(&pool);
+	
+	free(line);
+	munmap(batch, JSONFIELD_BATCH_SIZE);
+	
+	return r && fflush(out) == 0;
+}
+
+/*
+ * The jsonfield_worker() function is the main loop of a worker process.
+ * For each run of lines read from the command pipe it processes the lines
+ * in to memory, then writes the length of the output followed by the
+ * output to the result pipe. It returns when the command pipe is closed.
+ */
+static void jsonfield_worker(int index, int cmd, int result) {
+	size_t run[2];
+	size_t size, n;
+	ssize_t w;
+	char *output;
+	FILE *out;
+	
+	(void)index;
+	
+	while (read(cmd, run, sizeof(run)) == sizeof(run)) {
+		if ((out = open_memstream(&output, &size)) == NULL)
+			break;
+		jsonfield_lines(batch + run[0], run[1], out);
+		if (fclose(out) != 0)
+			break;
+		
+		if (write(result, &size, sizeof(size)) != sizeof(size))
+			break;
+		for (n = 0; n < size; n += w)
+			if ((w = write(result, output + n, size - n)) <= 0)
+				break;
+		free(output);
+		if (n < size)
+			break;
+	}
+}
+
+/*
+ * The jsonfield_flush() function splits the first used bytes of the batch
+ * in to one run of whole lines per worker, hands each worker its run, and
+ * writes the outputs to out in the order of the runs.
+ * 
+ * Zero is returned if a worker fails or writing fails.
+ */
+static int jsonfield_flush(size_t used, FILE *out) {
+	int i;
+	int r = 1;
+	size_t run[2];
+	size_t start = 0;
+	size_t end;
+	char *p;
+	char *outputs[WORKERS_MAX];
+	size_t lengths[WORKERS_MAX];
+	
+	// Hand out runs of about equal size that end on a line boundary
+	for (i = 0; i < pool.count; ++i) {
+		end = i == pool.count - 1 ? used : start + (used - start) / (pool.count - i);
+		if (end > start && end < used) {
+			if ((p = memchr(batch + end - 1, '\n', used - (end - 1))) == NULL)
+				end = used;
+			else
+				end = (p - batch) + 1;
+		}
+		run[0] = start;
+		run[1] = end - start;
+		if (write(pool.cmds[i], run, sizeof(run)) != sizeof(run))
+			return 0;
+		start = end;
+	}
+	
+	if (jsonfield_collect(outputs, lengths) == 0)
+		r = 0;
+	
+	for (i = 0; i < pool.count; ++i) {
+		if (r && fwrite(outputs[i], 1, lengths[i], out) != lengths[i])
+			r = 0;
+		free(outputs[i]);
+	}
+	
+	return r;
+}
+
+/*
+ * The jsonfield_collect() function reads the output of every worker for
+ * the current batch. The result pipes are drained together, so no worker
+ * waits on a full pipe while another one is read. Each output is returned
+ * in outputs with its length in lengths, and must be freed by the caller.
+ * 
+ * Zero is returned if any worker fails.
+ */
+static int jsonfield_collect(char **outputs, size_t *lengths) {
+	int i, k, p;
+	int r = 1;
+	int owner[WORKERS_MAX];
+	size_t got[WORKERS_MAX];
+	ssize_t n;
+	struct pollfd pfds[WORKERS_MAX];
+	
+	for (i = 0; i < pool.count; ++i) {
+		outputs[i] = NULL;
+		got[i] = 0;
+	}
+	
+	for (;;) {
+
+		// Wait on every worker whose output is not complete
+		for (i = 0, p = 0; i < pool.count; ++i) {
+			if (got[i] < sizeof(size_t) || got[i] < sizeof(size_t) + lengths[i]) {
+				pfds[p].fd = pool.results[i];
+				pfds[p].events = POLLIN;
+				owner[p++] = i;
+			}
+		}
+		if (p == 0)
+			break;
+		
+		if (poll(pfds, p, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			r = 0;
+			break;
+		}
+		
+		for (k = 0; k < p; ++k) {
+			if (pfds[k].revents == 0)
+				continue;
+			i = owner[k];
+
+			// Read the output length, then the output
+			if (got[i] < sizeof(size_t)) {
+				n = read(pool.results[i], (char *)&lengths[i] + got[i], sizeof(size_t) - got[i]);
+				if (n > 0 && got[i] + n == sizeof(size_t) && (outputs[i] = malloc(lengths[i] + 1)) == NULL)
+					n = 0;
+			} else {
+				n = read(pool.results[i], outputs[i] + (got[i] - sizeof(size_t)), lengths[i] - (got[i] - sizeof(size_t)));
+			}
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				r = 0;
+				break;
+			}
+			got[i] += n;
+		}
+		if (r == 0)
+			break;
+	}
+	
+	// Outputs that did not arrive are written as nothing
+	for (i = 0; r == 0 && i < pool.count; ++i)
+		lengths[i] = 0;
+	
+	return r;
+}
+
+/*
+ * The jsonfield_lines() function processes a run of whole lines.
+ */
+static void jsonfield_lines(char *lines, size_t length, FILE *out) {
+	char *p, *q;
+	char *end = lines + length;
+	
+	for (p = lines; p < end; p = q) {
+		q = memchr(p, '\n', end - p);
+		q = q == NULL ? end : q + 1;
+		jsonfield_line(p, q - p, out);
+	}
+}
+
+/*
+ * The jsonfield_line() function scans one document and writes it to out,
+ * replacing each selected string value as it is found. Anything that can
+ * not be scanned is written unchanged.
+ */
+static void jsonfield_line(char *line, size_t length, FILE *out) {
+	int depth = 0;
+	char *p = line;
+	char *q;
+	char *copied = line;
+	char *end = line + length;
+	struct jsonframe frames[JSONFIELD_MAX_DEPTH];
+	
+	while (p < end) {
+		switch (*p) {
+			case '{':
+			case '[':
+				if (depth == JSONFIELD_MAX_DEPTH) {
+					p = end;
+					break;
+				}
+				frames[depth].object = *p == '{';
+				frames[depth].expectKey = *p == '{';
+				frames[depth].key = NULL;
+				frames[depth].keyLength = 0;
+				++depth;
+				++p;
+				break;
+			case '}':
+			case ']':
+				if (depth > 0)
+					--depth;
+				++p;
+				break;
+			case ':':
+				if (depth > 0)
+					frames[depth - 1].expectKey = 0;
+				++p;
+				break;
+			case ',':
+				if (depth > 0 && frames[depth - 1].object)
+					frames[depth - 1].expectKey = 1;
+				++p;
+				break;
+			case '"':
+				if ((q = jsonfield_string_end(p + 1, end)) == NULL) {
+					p = end;
+					break;
+				}
+				
+				// Object key, or selected value
+				if (depth > 0 && frames[depth - 1].object && frames[depth - 1].expectKey) {
+					frames[depth - 1].key = p + 1;
+					frames[depth - 1].keyLength = q - (p + 1);
+				} else if (jsonfield_match(frames, depth)) {
+					fwrite(copied, 1, (p + 1) - copied, out);
+					jsonfield_value(p + 1, q - (p + 1), out);
+					copied = q;
+				}
+
+				p = q + 1;
+				break;
+			default:
+				++p;
+				break;
+		}
+	}
+	
+	fwrite(copied, 1, end - copied, out);
+}
+
+/*
+ * The jsonfield_string_end() function returns a pointer to the quote that
+ * closes the string starting at p, or NULL if the string is not closed
+ * before end.
+ */
+static char *jsonfield_string_end(char *p, char *end) {
+	char *q, *b;
+	
+	while ((q = memchr(p, '"', end - p)) != NULL) {
+
+		// The quote is escaped if preceded by an odd number of backslashes
+		for (b = q; b > p && *(b - 1) == '\\'; --b)
+			;
+		if ((q - b) % 2 == 0)
+			return q;
+
+		p = q + 1;
+	}
+	
+	return NULL;
+}
+
+/*
+ * The jsonfield_match() function checks whether the keys of the enclosing
+ * objects match any of the selected paths. Values inside arrays are never
+ * selected.
+ */
+static int jsonfield_match(struct jsonframe *frames, int depth) {
+	int i, j;
+	
+	for (i = 0; i < pathCount; ++i) {
+		if (paths[i].count != depth)
+			continue;
+		for (j = 0; j < depth; ++j)
+			if (!frames[j].object || frames[j].key == NULL
+			    || frames[j].keyLength != paths[i].lengths[j]
+			    || memcmp(frames[j].key, paths[i].keys[j], frames[j].keyLength) != 0)
+				break;
+		if (j == depth)
+			return 1;
+	}
+	
+	return 0;
+}
+
+/*
+ * The jsonfield_value() function writes the replacement for a selected
+ * string value, given as the raw text between its quotes. When
+ * decrypting, the value is passed to jsonfield_decrypt(). Otherwise it
+ * is encrypted and armored, even if it already looks armored.
+ */
+static void jsonfield_value(char *value, size_t length, FILE *out) {
+	size_t i;
+	base64 contents = { .index = 0, .error = 0 };
+	struct mirrorfield mf;
+	
+	if (decrypt) {
+		jsonfield_decrypt(value, length, out);
+		return;
+	}
+	
+	mirrorfield_clone(&mf, template);
+	
+	// Encrypt and armor value
+	fputs(JSONFIELD_PREFIX, out);
+	for (i = 0; i < length; ++i) {
+		contents.decoded[contents.index++] = mirrorfield_crypt_byte(&mf, value[i], 0);
+		if (contents.index == BASE64_DECODED_COUNT || i == length - 1) {
+			contents = base64_encode(contents);
+			fwrite(contents.encoded, 1, BASE64_ENCODED_COUNT, out);
+			contents.index = 0;
+		}
+	}
+}
+
+/*
+ * The jsonfield_decrypt() function decrypts an armored value in to
+ * memory and writes it only if the result is valid JSON string text, as
+ * the original value was. A value without the prefix, one that does not
+ * decode, or one that decrypts to anything else is written unchanged.
+ */
+static void jsonfield_decrypt(char *value, size_t length, FILE *out) {
+	size_t i, j, n;
+	size_t prefix = strlen(JSONFIELD_PREFIX);
+	size_t count = 0;
+	unsigned char *plain;
+	base64 contents = { .index = 0, .error = 0 };
+	struct mirrorfield mf;
+	
+	if (length < prefix || strncmp(value, JSONFIELD_PREFIX, prefix) != 0 || (length - prefix) % BASE64_ENCODED_COUNT != 0) {
+		fwrite(value, 1, length, out);
+		return;
+	}
+	
+	if ((plain = malloc((length - prefix) / BASE64_ENCODED_COUNT * BASE64_DECODED_COUNT + 1)) == NULL) {
+		fwrite(value, 1, length, out);
+		return;
+	}
+	
+	mirrorfield_clone(&mf, template);
+	
+	for (i = prefix; i < length; i += BASE64_ENCODED_COUNT) {
+		memcpy(contents.encoded, value + i, BASE64_ENCODED_COUNT);
+		n = BASE64_DECODED_COUNT;
+		if (i + BASE64_ENCODED_COUNT == length)
+			n -= (value[length - 1] == '=') + (value[length - 2] == '=');
+		contents = base64_decode(contents);
+		if (contents.error)
+			break;
+		for (j = 0; j < n; ++j)
+			plain[count++] = mirrorfield_crypt_byte(&mf, contents.decoded[j], 0);
+	}
+	
+	if (!contents.error && jsonfield_valid(plain, count))
+		fwrite(plain, 1, count, out);
+	else
+		fwrite(value, 1, length, out);
+	
+	free(plain);
+}
+
+/*
+ * The jsonfield_valid() function checks that text can stand between the
+ * quotes of a JSON string: valid UTF-8 with no control characters, no
+ * unescaped quotes, and only valid escape sequences.
+ */
+static int jsonfield_valid(const unsigned char *text, size_t length) {
+	size_t i, j, n;
+	uint32_t c;
+	
+	for (i = 0; i < length; ) {
+		c = text[i];
+		
+		// Control characters and unescaped quotes
+		if (c < 0x20 || c == '"')
+			return 0;
+		
+		// Escape sequences
+		if (c == '\\') {
+			if (i + 1 == length || strchr("\"\\/bfnrtu", text[i + 1]) == NULL || text[i + 1] == '\0')
+				return 0;
+			if (text[i + 1] == 'u') {
+				if (i + 6 > length)
+					return 0;
+				for (j = i + 2; j < i + 6; ++j)
+					if (strchr("0123456789abcdefABCDEF", text[j]) == NULL || text[j] == '\0')
+						return 0;
+				i += 6;
+			} else {
+				i += 2;
+			}
+			continue;
+		}
+		
+		if (c < 0x80) {
+			++i;
+			continue;
+		}
+		
+		// Multi-byte UTF-8 sequences, without overlong forms or surrogates
+		if (c >= 0xC2 && c <= 0xDF) {
+			n = 1;
+			c &= 0x1F;
+		} else if (c >= 0xE0 && c <= 0xEF) {
+			n = 2;
+			c &= 0x0F;
+		} else if (c >= 0xF0 && c <= 0xF4) {
+			n = 3;
+			c &= 0x07;
+		} else {
+			return 0;
+		}
+		if (i + n >= length)
+			return 0;
+		for (j = 1; j <= n; ++j) {
+			if ((text[i + j] & 0xC0) != 0x80)
+				return 0;
+			c = (c << 6) | (text[i + j] & 0x3F);
+		}
+		if ((n == 2 && (c < 0x800 || (c >= 0xD800 && c <= 0xDFFF))) || (n == 3 && (c < 0x10000 || c > 0x10FFFF)))
+			return 0;
+		i += n + 1;
+	}
+	
+	return 1;
+}
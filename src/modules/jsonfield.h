@@ -0,0 +1,35 @@
+// Copyright (c) 2017 Brian Barto
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GPL License. See LICENSE for more details.
+
+#ifndef JSONFIELD_H
+#define JSONFIELD_H 1
+
+#include <stdio.h>
+#include "modules/mirrorfield.h"
+
+/*
+ * Prefix that marks an encrypted, base64 armored string value.
+ */
+#define JSONFIELD_PREFIX       "mrr64:"
+
+/*
+ * Maximum nesting depth of arrays and objects that is scanned. Values
+ * nested deeper than this are left unchanged.
+ */
+#define JSONFIELD_MAX_DEPTH    64
+
+/*
+ * Size in bytes of the batch of lines that is split between the worker
+ * processes. Longer lines are processed by the main process.
+ */
+#define JSONFIELD_BATCH_SIZE   4194304
+
+/*
+ * Function Prototypes
+ */
+int  jsonfield_paths(char *);
+int  jsonfield_crypt(FILE *, FILE *, const struct mirrorfield *, int, int);
+
+#endif
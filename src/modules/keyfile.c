@@ -9,6 +9,8 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <time.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/stat.h>
 
 #include "main.h"
@@ -35,17 +37,45 @@ void keyfile_init(void) {
 
 /*
  * The keyfile_open() function attempts to open the keyfile specified in
- * the keyFileName parameter. If keyFileName does not contain an absolute
- * path, it will use $HOME/DEFAULT_KEY_PATH as the path to the directory
- * that contains the specified key file.
+ * the keyFileName parameter. The full path of the key file is determined
+ * by keyfile_path().
  * 
  * If the key file is not found and the autoCreate flag is set, it will
  * call the keyfile_create() function to attempt to create a new key file
- * at the determined path.
+ * at the determined path. If another process creates the key file first,
+ * the key file it created is opened instead.
  * 
  * Upon any errors, zero is returned.
  */
 int keyfile_open(char *keyFileName, int autoCreate) {
+	char *keyFileFullPathName;
+	
+	// Return if we can't determine the path
+	if ((keyFileFullPathName = keyfile_path(keyFileName)) == NULL)
+		return 0;
+
+	// Open key file, creating it first if it is not found
+	keyFile = fopen(keyFileFullPathName, "r");
+	if (keyFile == NULL && errno == ENOENT && autoCreate)
+		if (keyfile_create(keyFileFullPathName) || errno == EEXIST)
+			keyFile = fopen(keyFileFullPathName, "r");
+	
+	// Return zero if we can't open the key file
+	if (keyFile == NULL)
+		return 0;
+	
+	return 1;
+}
+
+/*
+ * The keyfile_path() function returns the full path of the key file
+ * specified in the keyFileName parameter. If keyFileName does not contain
+ * an absolute path, it will use $HOME/DEFAULT_KEY_PATH as the path to the
+ * directory that contains the specified key file.
+ * 
+ * NULL is returned if we don't have a home directory.
+ */
+char *keyfile_path(char *keyFileName) {
 	char *homeDir              = getenv("HOME");
 	char *keyFilePath          = DEFAULT_KEY_PATH;
 	char *keyFilePathName;
@@ -53,119 +83,79 @@ int keyfile_open(char *keyFileName, int autoCreate) {
 	
 	// Return if we don't have a home directory
 	if (homeDir == NULL)
-		return 0;
+		return NULL;
 	
 	// Check if we have an absolute path	
-	if (*keyFileName == '/') {
-	
-		// Assign to full path variable
-		keyFileFullPathName = keyFileName;
+	if (*keyFileName == '/')
+		return keyFileName;
 
-	} else {
+	// Combine default file path and name in to one string.
+	keyFilePathName = malloc(strlen(keyFilePath) + strlen(keyFileName) + 1);
+	sprintf(keyFilePathName, "%s%s", keyFilePath, keyFileName);
+	
+	// Build key file path
+	keyFileFullPathName = malloc(strlen(keyFilePathName) + strlen(homeDir) + 2);
+	sprintf(keyFileFullPathName, "%s/%s", homeDir, keyFilePathName);
+	
+	free(keyFilePathName);
 
-		// Combine default file path and name in to one string.
-		keyFilePathName = malloc(strlen(keyFilePath) + strlen(keyFileName) + 1);
-		sprintf(keyFilePathName, "%s%s", keyFilePath, keyFileName);
-		
-		// Build key file path
-		keyFileFullPathName = malloc(strlen(keyFilePathName) + strlen(homeDir) + 2);
-		sprintf(keyFileFullPathName, "%s/%s", homeDir, keyFilePathName);
-		
-		// Build key file path
-		keyFileFullPathName = malloc(strlen(keyFilePathName) + strlen(homeDir) + 2);
-		sprintf(keyFileFullPathName, "%s/%s", homeDir, keyFilePathName);
-	}
+	return keyFileFullPathName;
+}
 
-	// Open key file
-	while ((keyFile = fopen(keyFileFullPathName, "r")) == NULL) {
-		if (autoCreate) {
-			if (keyfile_create(keyFileFullPathName)) {
-				continue;
-			} 
-		} 
-		break;
-	}
+/*
+ * The keyfile_create() function creates a new key file at the given path,
+ * populated with a new randomized key from keyfile_generate().
+ * 
+ * Upon any errors, zero is returned.
+ */
+int keyfile_create(char *keyFileFullPathName) {
+	unsigned char key[KEYFILE_KEY_SIZE];
 	
-	// Return zero if we can't open the key file
-	if (keyFile == NULL)
+	if (keyfile_generate(key) == 0)
 		return 0;
 	
-	return 1;
+	return keyfile_write(keyFileFullPathName, key);
 }
 
 /*
- * The keyfile_create() function creates a new key file at the given path.
- * A full absolute path and name must be provided as a single character
- * string. It will attempt to create any missing directories in the path
- * if necessary.
- * 
- * Upon successfully creating the key file, it will also populate the file
- * with a new randomized key.
+ * The keyfile_generate() function fills the key buffer, which must be
+ * KEYFILE_KEY_SIZE bytes, with a new randomized key: the mirrors for each
+ * mirror field followed by the perimeter characters for each mirror
+ * field.
  * 
  * Upon any errors, zero is returned.
  */
-int keyfile_create(char *keyFileFullPathName) {
+int keyfile_generate(unsigned char *key) {
 	int i, j, r;
-	int w = 0;
-	struct stat sb;
-	FILE *keyfile;
+	int k = 0;
 	FILE *urandom;
 	unsigned char perimeterChars[GRID_SIZE * 4];
-	base64 contents = { .index = 0 };
-
-	// Check subdirs and create them if needed
-	if (strchr(keyFileFullPathName, '/') != NULL) {
-		for (i = 1; keyFileFullPathName[i] != '\0'; ++i) {
-			if (keyFileFullPathName[i] == '/') {
-				keyFileFullPathName[i] = '\0';
-				if (stat(keyFileFullPathName, &sb) != 0)
-					if (mkdir(keyFileFullPathName, 0700) == -1)
-						return 0;
-				keyFileFullPathName[i] = '/';
-			}
-		}
-	}
 
-	// Open the key file
-	if ((keyfile = fopen(keyFileFullPathName, "w")) == NULL)
-		return 0;
-		
 	// Open the urandom resource
 	if ((urandom = fopen("/dev/urandom", "r")) == NULL)
 		return 0;
 
-	// Write mirror data to file
+	// Generate mirror data
 	for (i = 0; i < MIRROR_FIELD_COUNT * GRID_SIZE * GRID_SIZE; ++i) {
 	
 		// Randomly generate mirror char
 		switch (fgetc(urandom) % 5) {
 			case 0:
-				contents.decoded[contents.index++] = '/';
+				key[k++] = '/';
 				break;
 			case 1:
-				contents.decoded[contents.index++] = '\\';
+				key[k++] = '\\';
 				break;
 			case 2:
-				contents.decoded[contents.index++] = '-';
+				key[k++] = '-';
 				break;
 			default:
-				contents.decoded[contents.index++] = ' ';
+				key[k++] = ' ';
 				break;
 		}
-
-		// If we have max input for the base64 encoder, encode it
-		if (contents.index == BASE64_DECODED_COUNT) {
-			contents = base64_encode(contents);
-			fprintf(keyfile, "%c%c%c%c", contents.encoded[0], contents.encoded[1], contents.encoded[2], contents.encoded[3]);
-			contents.index = 0;
-
-			// Newline after every 72 chars (18 * 4)
-			if (++w % 18 == 0)
-				fprintf(keyfile, "\n");
-		}
 	}
 	
-	// Write perimeter character data to file
+	// Generate perimeter character data
 	for (j = 0; j < MIRROR_FIELD_COUNT; ++j) {
 
 		// init all perimeter chars to zero
@@ -186,37 +176,99 @@ int keyfile_create(char *keyFileFullPathName) {
 			perimeterChars[r] = i;
 		}
 		
-		// Encode perimeter chars to base64 and write to key file
-		for (i = 0; i < GRID_SIZE * 4; ++i) {
-			contents.decoded[contents.index++] = perimeterChars[i];
-			if (contents.index == BASE64_DECODED_COUNT) {
-				contents = base64_encode(contents);
-				fprintf(keyfile, "%c%c%c%c", contents.encoded[0], contents.encoded[1], contents.encoded[2], contents.encoded[3]);
-				contents.index = 0;
-				
-				// Newline after every 72 chars (18 * 4)
-				if (++w % 18 == 0)
-					fprintf(keyfile, "\n");
+		for (i = 0; i < GRID_SIZE * 4; ++i)
+			key[k++] = perimeterChars[i];
+	}
+	
+	// Close urandom resource
+	fclose(urandom);
+
+	return 1;
+}
+
+/*
+ * The keyfile_write() function writes the key, which must be
+ * KEYFILE_KEY_SIZE bytes, to a new key file at the given path. A full
+ * absolute path and name must be provided as a single character string.
+ * It will attempt to create any missing directories in the path if
+ * necessary. An existing file is never overwritten.
+ * 
+ * The key is written to a temporary file, readable only by the owner, in
+ * the same directory, which is then linked in to place. Another process
+ * racing to create the same key file either finds it complete or not at
+ * all, and link() fails rather than replace it.
+ * 
+ * Upon any errors, zero is returned. If the file already exists, errno
+ * is EEXIST.
+ */
+int keyfile_write(char *keyFileFullPathName, unsigned char *key) {
+	int i, fd, e;
+	int w = 0;
+	int r = 0;
+	struct stat sb;
+	char *tmpName;
+	FILE *keyfile;
+	base64 contents = { .index = 0 };
+
+	// Check subdirs and create them if needed
+	if (strchr(keyFileFullPathName, '/') != NULL) {
+		for (i = 1; keyFileFullPathName[i] != '\0'; ++i) {
+			if (keyFileFullPathName[i] == '/') {
+				keyFileFullPathName[i] = '\0';
+				if (stat(keyFileFullPathName, &sb) != 0)
+					if (mkdir(keyFileFullPathName, 0700) == -1)
+						return 0;
+				keyFileFullPathName[i] = '/';
 			}
 		}
 	}
+
+	// Create the temporary key file. mkstemp() makes it readable only by
+	// the owner.
+	if ((tmpName = malloc(strlen(keyFileFullPathName) + 8)) == NULL)
+		return 0;
+	sprintf(tmpName, "%s.XXXXXX", keyFileFullPathName);
+	if ((fd = mkstemp(tmpName)) == -1) {
+		free(tmpName);
+		return 0;
+	}
+	if ((keyfile = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmpName);
+		free(tmpName);
+		return 0;
+	}
 	
-	if (contents.index > 0) {
-		contents = base64_encode(contents);
-		fprintf(keyfile, "%c%c%c%c", contents.encoded[0], contents.encoded[1], contents.encoded[2], contents.encoded[3]);
+	// Encode key to base64 and write to key file
+	for (i = 0; i < KEYFILE_KEY_SIZE; ++i) {
+		contents.decoded[contents.index++] = key[i];
 
-		// Newline after every 72 chars (18 * 4)
-		if (++w % 18 == 0)
-			fprintf(keyfile, "\n");
+		// If we have max input for the base64 encoder, encode it
+		if (contents.index == BASE64_DECODED_COUNT || i == KEYFILE_KEY_SIZE - 1) {
+			contents = base64_encode(contents);
+			fprintf(keyfile, "%c%c%c%c", contents.encoded[0], contents.encoded[1], contents.encoded[2], contents.encoded[3]);
+			contents.index = 0;
+
+			// Newline after every 72 chars (18 * 4)
+			if (++w % 18 == 0)
+				fprintf(keyfile, "\n");
+		}
 	}
 	
-	// Close urandom resource
-	fclose(urandom);
+	// Close the temporary file and publish it under the key file name
+	if (fflush(keyfile) == 0 && fsync(fd) == 0) {
+		if (fclose(keyfile) == 0 && link(tmpName, keyFileFullPathName) == 0)
+			r = 1;
+	} else {
+		fclose(keyfile);
+	}
 	
-	// Close mirror file
-	fclose(keyfile);
+	e = errno;
+	unlink(tmpName);
+	free(tmpName);
+	errno = e;
 
-	return 1;
+	return r;
 }
 
 /*
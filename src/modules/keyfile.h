@@ -6,12 +6,23 @@
 #ifndef KEYFILE_H
 #define KEYFILE_H 1
 
+#include "main.h"
+
+/*
+ * Size in bytes of a decoded key: the mirrors for every mirror field
+ * followed by the perimeter characters for every mirror field.
+ */
+#define KEYFILE_KEY_SIZE ((MIRROR_FIELD_COUNT * GRID_SIZE * GRID_SIZE) + (MIRROR_FIELD_COUNT * GRID_SIZE * 4))
+
 /*
  * Function Prototypes
  */
 void  keyfile_init(void);
 int   keyfile_open(char *, int);
+char *keyfile_path(char *);
 int   keyfile_create(char *);
+int   keyfile_generate(unsigned char *);
+int   keyfile_write(char *, unsigned char *);
 int   keyfile_next_char(void);
 void  keyfile_close(void);
 
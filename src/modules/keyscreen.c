@@ -0,0 +1,106 @@
+// Copyright (c) 2017 Brian Barto
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GPL License. See LICENSE for more details.
+
+#include <string.h>
+
+#include "main.h"
+#include "modules/keyfile.h"
+#include "modules/mirrorfield.h"
+#include "modules/keyscreen.h"
+
+/*
+ * MODULE DESCRIPTION
+ * 
+ * The keyscreen module checks the quality of a candidate key before it is
+ * written to a key file. The key is loaded in to a mirror field and two
+ * probe inputs, a run of zeros and a repeating byte counter, are each
+ * encrypted under a fresh copy of the field. A key whose fields hold few
+ * mirrors gives short traversal paths and an output that visibly follows
+ * the input. The byte distribution of each output is measured with a
+ * chi-square test, and the order of the bytes with the serial correlation
+ * of each byte to the next, which the byte counts do not capture. The key
+ * is rejected if either falls outside the KEYSCREEN thresholds.
+ */
+
+// Static Function Prototypes
+static int keyscreen_probe(const struct mirrorfield *, int);
+
+/*
+ * The keyscreen_check() function loads the key, which must be
+ * KEYFILE_KEY_SIZE bytes, in to a mirror field and runs each probe
+ * against it.
+ * 
+ * Returns non-zero if the key passes, zero otherwise.
+ */
+int keyscreen_check(const unsigned char *key) {
+	int i;
+	struct mirrorfield mf;
+
+	// Build mirror field from key
+	mirrorfield_init(&mf);
+	for (i = 0; i < KEYFILE_KEY_SIZE; ++i)
+		if (mirrorfield_set(&mf, key[i]) == 0)
+			break;
+
+	if (mirrorfield_validate(&mf) == 0)
+		return 0;
+
+	mirrorfield_link(&mf);
+
+	// Zeros, then a repeating byte counter
+	return keyscreen_probe(&mf, 0) && keyscreen_probe(&mf, 1);
+}
+
+/*
+ * The keyscreen_probe() function encrypts KEYSCREEN_PROBE_SIZE bytes of a
+ * probe input under a copy of the given mirror field and measures the
+ * byte distribution and serial correlation of the output. When counter is
+ * zero the input is all zeros, otherwise it counts up through every byte
+ * value.
+ * 
+ * Returns non-zero if the output is within the thresholds, zero otherwise.
+ */
+static int keyscreen_probe(const struct mirrorfield *key, int counter) {
+	int i, ch;
+	int first = 0, last = 0;
+	long counts[256];
+	double chi = 0.0, serial;
+	double sum = 0.0, squares = 0.0, products = 0.0;
+	double n = KEYSCREEN_PROBE_SIZE;
+	double expected = n / 256.0;
+	struct mirrorfield mf;
+
+	mirrorfield_clone(&mf, key);
+	memset(counts, 0, sizeof(counts));
+
+	for (i = 0; i < KEYSCREEN_PROBE_SIZE; ++i) {
+		ch = mirrorfield_crypt_byte(&mf, counter ? (i & 0xFF) : 0, 0);
+		++counts[ch];
+		sum += ch;
+		squares += (double)ch * ch;
+		if (i == 0)
+			first = ch;
+		else
+			products += (double)last * ch;
+		last = ch;
+	}
+	
+	// The last byte is paired with the first
+	products += (double)last * first;
+
+	for (i = 0; i < 256; ++i)
+		chi += (counts[i] - expected) * (counts[i] - expected) / expected;
+
+	if (chi < KEYSCREEN_CHI_MIN || chi > KEYSCREEN_CHI_MAX)
+		return 0;
+	
+	// A constant output has no defined correlation, and the chi-square
+	// test has already rejected it
+	serial = (n * products - sum * sum) / (n * squares - sum * sum);
+	if (serial < -KEYSCREEN_SERIAL_MAX || serial > KEYSCREEN_SERIAL_MAX)
+		return 0;
+
+	return 1;
+}
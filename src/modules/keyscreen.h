@@ -0,0 +1,39 @@
+// Copyright (c) 2017 Brian Barto
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GPL License. See LICENSE for more details.
+
+#ifndef KEYSCREEN_H
+#define KEYSCREEN_H 1
+
+/*
+ * Number of bytes of each probe input encrypted under a candidate key.
+ */
+#define KEYSCREEN_PROBE_SIZE   65536
+
+/*
+ * Acceptable range for the chi-square statistic of the byte distribution
+ * of a probe's output. With 255 degrees of freedom a good key falls
+ * between these values well over 99% of the time.
+ */
+#define KEYSCREEN_CHI_MIN      190.0
+#define KEYSCREEN_CHI_MAX      330.0
+
+/*
+ * Largest acceptable serial correlation between successive bytes of a
+ * probe's output. Good keys stay within about 0.012.
+ */
+#define KEYSCREEN_SERIAL_MAX   0.02
+
+/*
+ * Number of candidate keys that may be screened for each key that is
+ * needed before screening gives up.
+ */
+#define KEYSCREEN_MAX_TRIES    100
+
+/*
+ * Function Prototypes
+ */
+int   keyscreen_check(const unsigned char *);
+
+#endif
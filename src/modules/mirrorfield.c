@@ -9,6 +9,7 @@
 #include <time.h>
 #include "main.h"
 #include "modules/mirrorfield.h"
+#include "modules/profile.h"
 
 /*
  * MODULE DESCRIPTION
@@ -28,64 +29,59 @@
 #define DIR_LEFT          3
 #define DIR_RIGHT         4
 
-// Static Variables
-//static int grid[GRID_SIZE * GRID_SIZE];
-//static unsigned char perimeterChars[GRID_SIZE * 4];
-
-struct gridnode {
-	int value;
-	struct gridnode *up;
-	struct gridnode *down;
-	struct gridnode *left;
-	struct gridnode *right;
-};
-static struct gridnode gridnodes[MIRROR_FIELD_COUNT][GRID_SIZE * GRID_SIZE];
-static struct gridnode perimeter[MIRROR_FIELD_COUNT][GRID_SIZE * 4];
-
 // Static Function Prototypes
-static struct gridnode *mirrorfield_crypt_char_advance(struct gridnode *, int, int, int);
-static void mirrorfield_roll_chars(int, int, int);
-static void mirrorfield_draw(struct gridnode *, int);
+static void mirrorfield_pack_bits(unsigned char *, int, int, int);
+static int  mirrorfield_unpack_bits(const unsigned char *, int, int);
+static struct gridnode *mirrorfield_crypt_char_advance(struct mirrorfield *, struct gridnode *, int, int, int);
+static void mirrorfield_roll_chars(struct mirrorfield *, int, int, int);
+static void mirrorfield_draw(struct mirrorfield *, struct gridnode *, int);
 
 /*
- * The mirrorfield_init() function initializes any static variables.
+ * The mirrorfield_init() function initializes the mirror field structure
+ * so that it is ready to be loaded with mirrorfield_set().
  */
-void mirrorfield_init(void) {
+void mirrorfield_init(struct mirrorfield *mf) {
 	int i, j;
 	
+	mf->setIndex = 0;
+	mf->fieldIndex = 0;
+	mf->rollIndex1 = 0;
+	mf->rollIndex2 = GRID_SIZE * 2;
+	mf->rollCount = 0;
+	
 	for (j = 0; j < MIRROR_FIELD_COUNT; ++j) {
 
 		// Init gridnode values
 		for (i = 0; i < GRID_SIZE * GRID_SIZE; ++i) {
-			gridnodes[j][i].value = 0;
-			gridnodes[j][i].up = NULL;
-			gridnodes[j][i].down = NULL;
-			gridnodes[j][i].left = NULL;
-			gridnodes[j][i].right = NULL;
+			mf->gridnodes[j][i].value = 0;
+			mf->gridnodes[j][i].up = NULL;
+			mf->gridnodes[j][i].down = NULL;
+			mf->gridnodes[j][i].left = NULL;
+			mf->gridnodes[j][i].right = NULL;
 		}
 		
 		// Init perimeter values
 		for (i = 0; i < GRID_SIZE * 4; ++i) {
-			perimeter[j][i].value = 0;
-			perimeter[j][i].up = NULL;
-			perimeter[j][i].down = NULL;
-			perimeter[j][i].left = NULL;
-			perimeter[j][i].right = NULL;
+			mf->perimeter[j][i].value = 0;
+			mf->perimeter[j][i].up = NULL;
+			mf->perimeter[j][i].down = NULL;
+			mf->perimeter[j][i].left = NULL;
+			mf->perimeter[j][i].right = NULL;
 		}
 	}
 }
 
 /*
  * The mirrorfield_set() function accepts one character at a time and
- * loads them sequentially into the static variables that contain the
+ * loads them sequentially into the mirror field structure that contains the
  * mirror field and perimeter characters.
  * 
  * Zero is returned if it gets a character it doesn't expect, although
  * this is just a cursory error checking process. 
  */
-int mirrorfield_set(unsigned char ch) {
-	static int i = 0;
-	static int j = 0;
+int mirrorfield_set(struct mirrorfield *mf, unsigned char ch) {
+	int i = mf->setIndex;
+	int j;
 	
 	// Set mirror values
 	if (i < GRID_SIZE * GRID_SIZE * MIRROR_FIELD_COUNT) {
@@ -95,13 +91,13 @@ int mirrorfield_set(unsigned char ch) {
 	
 		// Set mirror value
 		if (ch == '/') {
-			gridnodes[j][i % (GRID_SIZE * GRID_SIZE)].value = MIRROR_FORWARD;
+			mf->gridnodes[j][i % (GRID_SIZE * GRID_SIZE)].value = MIRROR_FORWARD;
 		} else if (ch == '\\') {
-			gridnodes[j][i % (GRID_SIZE * GRID_SIZE)].value = MIRROR_BACKWARD;
+			mf->gridnodes[j][i % (GRID_SIZE * GRID_SIZE)].value = MIRROR_BACKWARD;
 		} else if (ch == '-') {
-			gridnodes[j][i % (GRID_SIZE * GRID_SIZE)].value = MIRROR_STRAIGHT;
+			mf->gridnodes[j][i % (GRID_SIZE * GRID_SIZE)].value = MIRROR_STRAIGHT;
 		} else if (ch == ' ') {
-			gridnodes[j][i % (GRID_SIZE * GRID_SIZE)].value = MIRROR_NONE;
+			mf->gridnodes[j][i % (GRID_SIZE * GRID_SIZE)].value = MIRROR_NONE;
 		} else {
 			return 0;
 		}
@@ -115,7 +111,7 @@ int mirrorfield_set(unsigned char ch) {
 		j = (i - (GRID_SIZE * GRID_SIZE * MIRROR_FIELD_COUNT)) / (GRID_SIZE * 4);
 		
 		// Setting perimeter value by index
-		perimeter[j][(i - (GRID_SIZE * GRID_SIZE * MIRROR_FIELD_COUNT)) % (GRID_SIZE * 4)].value = (int)ch;
+		mf->perimeter[j][(i - (GRID_SIZE * GRID_SIZE * MIRROR_FIELD_COUNT)) % (GRID_SIZE * 4)].value = (int)ch;
 	} 
 	
 	// Ignore extra characters
@@ -123,39 +119,43 @@ int mirrorfield_set(unsigned char ch) {
 		return 0;
 	}
 	
-	// Increment our static counter
-	++i;
+	// Increment our load counter
+	mf->setIndex = i + 1;
 	
 	return 1;
 }
 
 /*
  * The mirrorfield_validate() function checks that the data contained in
- * the static variables for the mirror field and perimeter character is
+ * the mirror field structure for the mirrors and perimeter characters is
  * valid.
  * 
  * Zero is returned if invalid.
  */
-int mirrorfield_validate(void) {
-	int i, j, k;
+int mirrorfield_validate(struct mirrorfield *mf) {
+	int i, k;
+	unsigned char seen[(GRID_SIZE * 4 + 7) / 8];
 
 	// Check mirrors
 	for (k = 0; k < MIRROR_FIELD_COUNT; ++k) {
 		for (i = 0; i < GRID_SIZE * GRID_SIZE; ++i) {
-			if (gridnodes[k][i].value > MIRROR_NONE || gridnodes[k][i].value < MIRROR_BACKWARD) {
+			if (mf->gridnodes[k][i].value > MIRROR_NONE || mf->gridnodes[k][i].value < MIRROR_BACKWARD) {
 				return 0;
 			}
 		}
 	}
 	
-	// Check for duplicate perimeter chars
+	// Check perimeter chars are in range and not duplicated
 	for (k = 0; k < MIRROR_FIELD_COUNT; ++k) {
+		memset(seen, 0, sizeof(seen));
 		for (i = 0; i < GRID_SIZE * 4; ++i) {
-			for (j = i+1; j < GRID_SIZE * 4; ++j) {
-				if (perimeter[k][i].value == perimeter[k][j].value) {
-					return 0;
-				}
+			if (mf->perimeter[k][i].value >= GRID_SIZE * 4) {
+				return 0;
 			}
+			if (seen[mf->perimeter[k][i].value / 8] & (1 << (mf->perimeter[k][i].value % 8))) {
+				return 0;
+			}
+			seen[mf->perimeter[k][i].value / 8] |= 1 << (mf->perimeter[k][i].value % 8);
 		}
 	}
 	
@@ -164,68 +164,207 @@ int mirrorfield_validate(void) {
 
 /*
  * The mirrorfield_link() function creates links between nodes to speed
- * up the encryption/decryption process.
+ * up the encryption/decryption process. Empty cells never change, so
+ * they are left out of the links and each node links directly to the
+ * next mirror, or perimeter character, in each direction. It also builds
+ * the map from perimeter character to perimeter position.
  */
-void mirrorfield_link(void) {
+void mirrorfield_link(struct mirrorfield *mf) {
 	int i, j, k;
 	struct gridnode *temp;
 	
 	// Looping over each mirror field
 	for (k = 0; k < MIRROR_FIELD_COUNT; ++k) {
 
+		// Map perimeter chars to their positions
+		for (i = 0; i < GRID_SIZE * 4; ++i)
+			mf->position[k][mf->perimeter[k][i].value] = i;
+		
+		// Unlink empty cells
+		for (j = 0; j < GRID_SIZE * GRID_SIZE; ++j) {
+			if (mf->gridnodes[k][j].value == MIRROR_NONE) {
+				mf->gridnodes[k][j].up = NULL;
+				mf->gridnodes[k][j].down = NULL;
+				mf->gridnodes[k][j].left = NULL;
+				mf->gridnodes[k][j].right = NULL;
+			}
+		}
+
 		// Linking up/down
 		for (i = 0; i < GRID_SIZE; ++i) {
 
-			temp = &perimeter[k][i];
+			temp = &mf->perimeter[k][i];
 	
 			for (j = i; j < GRID_SIZE * GRID_SIZE; j += GRID_SIZE) {
-				temp->down = &gridnodes[k][j];
-				gridnodes[k][j].up = temp;
-				temp = &gridnodes[k][j];
+				if (mf->gridnodes[k][j].value == MIRROR_NONE)
+					continue;
+				temp->down = &mf->gridnodes[k][j];
+				mf->gridnodes[k][j].up = temp;
+				temp = &mf->gridnodes[k][j];
 			}
 			
-			temp->down = &perimeter[k][i + (GRID_SIZE * 2)];
-			perimeter[k][i + (GRID_SIZE * 2)].up = temp;
+			temp->down = &mf->perimeter[k][i + (GRID_SIZE * 2)];
+			mf->perimeter[k][i + (GRID_SIZE * 2)].up = temp;
 		}
 
 		// Linking right/left
 		for (i = 0; i < GRID_SIZE; ++i) {
 			
-			temp = &perimeter[k][i + (GRID_SIZE * 3)];
+			temp = &mf->perimeter[k][i + (GRID_SIZE * 3)];
 			
 			for (j = i * GRID_SIZE; j < (i * GRID_SIZE) + GRID_SIZE; ++j) {
-					temp->right = &gridnodes[k][j];
-					gridnodes[k][j].left = temp;
-					temp = &gridnodes[k][j];
+					if (mf->gridnodes[k][j].value == MIRROR_NONE)
+						continue;
+					temp->right = &mf->gridnodes[k][j];
+					mf->gridnodes[k][j].left = temp;
+					temp = &mf->gridnodes[k][j];
 			}
 			
-			temp->right = &perimeter[k][i + GRID_SIZE];
-			perimeter[k][i + GRID_SIZE].left = temp;
+			temp->right = &mf->perimeter[k][i + GRID_SIZE];
+			mf->perimeter[k][i + GRID_SIZE].left = temp;
 		}
 
 	}
 }
 
+/*
+ * The mirrorfield_clone() function copies the complete state of the src
+ * mirror field in to dst and links the copy, giving the caller an
+ * independent field to encrypt with. A field that has been loaded,
+ * validated, and linked once can be kept unused as a template and cloned
+ * for each new stream, without re-reading the key file.
+ */
+void mirrorfield_clone(struct mirrorfield *dst, const struct mirrorfield *src) {
+	memcpy(dst, src, sizeof(struct mirrorfield));
+	mirrorfield_link(dst);
+}
+
+/*
+ * The mirrorfield_pack() function serializes the complete state of the
+ * mirror field in to MIRRORFIELD_PACKED_SIZE bytes. Each mirror is stored
+ * in 2 bits, each perimeter character in MIRRORFIELD_PERIMETER_BITS bits,
+ * and each counter in one byte. This is small enough to keep large numbers
+ * of idle streams in memory and restore them with mirrorfield_unpack().
+ */
+void mirrorfield_pack(const struct mirrorfield *mf, unsigned char *buf) {
+	int i, k;
+	int pos = 0;
+	
+	memset(buf, 0, MIRRORFIELD_PACKED_SIZE);
+	
+	// Pack mirrors. MIRROR_NONE through MIRROR_BACKWARD become 0 to 3.
+	for (k = 0; k < MIRROR_FIELD_COUNT; ++k) {
+		for (i = 0; i < GRID_SIZE * GRID_SIZE; ++i) {
+			mirrorfield_pack_bits(buf, pos, 2, MIRROR_NONE - mf->gridnodes[k][i].value);
+			pos += 2;
+		}
+	}
+	
+	// Pack perimeter chars
+	for (k = 0; k < MIRROR_FIELD_COUNT; ++k) {
+		for (i = 0; i < GRID_SIZE * 4; ++i) {
+			mirrorfield_pack_bits(buf, pos, MIRRORFIELD_PERIMETER_BITS, mf->perimeter[k][i].value);
+			pos += MIRRORFIELD_PERIMETER_BITS;
+		}
+	}
+	
+	// Pack counters
+	pos = (pos + 7) / 8;
+	buf[pos++] = mf->fieldIndex;
+	buf[pos++] = mf->rollIndex1;
+	buf[pos++] = mf->rollIndex2;
+	buf[pos++] = mf->rollCount;
+}
+
+/*
+ * The mirrorfield_unpack() function restores a mirror field from the
+ * bytes produced by mirrorfield_pack() and links it, so it is ready to
+ * continue encrypting where the packed stream left off.
+ * 
+ * Zero is returned if the unpacked field is invalid.
+ */
+int mirrorfield_unpack(struct mirrorfield *mf, const unsigned char *buf) {
+	int i, k;
+	int pos = 0;
+	
+	mirrorfield_init(mf);
+	
+	// Unpack mirrors
+	for (k = 0; k < MIRROR_FIELD_COUNT; ++k) {
+		for (i = 0; i < GRID_SIZE * GRID_SIZE; ++i) {
+			mf->gridnodes[k][i].value = MIRROR_NONE - mirrorfield_unpack_bits(buf, pos, 2);
+			pos += 2;
+		}
+	}
+	
+	// Unpack perimeter chars
+	for (k = 0; k < MIRROR_FIELD_COUNT; ++k) {
+		for (i = 0; i < GRID_SIZE * 4; ++i) {
+			mf->perimeter[k][i].value = mirrorfield_unpack_bits(buf, pos, MIRRORFIELD_PERIMETER_BITS);
+			pos += MIRRORFIELD_PERIMETER_BITS;
+		}
+	}
+	
+	// Unpack counters
+	pos = (pos + 7) / 8;
+	mf->fieldIndex = buf[pos++] % MIRROR_FIELD_COUNT;
+	mf->rollIndex1 = buf[pos++] % (GRID_SIZE * 4);
+	mf->rollIndex2 = buf[pos++] % (GRID_SIZE * 4);
+	mf->rollCount = buf[pos++] % MIRROR_FIELD_COUNT;
+	
+	// Mark the field as fully loaded
+	mf->setIndex = (GRID_SIZE * GRID_SIZE * MIRROR_FIELD_COUNT) + (GRID_SIZE * 4 * MIRROR_FIELD_COUNT);
+	
+	if (mirrorfield_validate(mf) == 0)
+		return 0;
+	
+	mirrorfield_link(mf);
+	
+	return 1;
+}
+
+/*
+ * The mirrorfield_pack_bits() function stores the low n bits of value in
+ * buf, starting at bit position pos.
+ */
+static void mirrorfield_pack_bits(unsigned char *buf, int pos, int n, int value) {
+	int i;
+	
+	for (i = 0; i < n; ++i, ++pos)
+		if (value & (1 << i))
+			buf[pos / 8] |= 1 << (pos % 8);
+}
+
+/*
+ * The mirrorfield_unpack_bits() function returns the n bit value stored
+ * in buf at bit position pos.
+ */
+static int mirrorfield_unpack_bits(const unsigned char *buf, int pos, int n) {
+	int i;
+	int value = 0;
+	
+	for (i = 0; i < n; ++i, ++pos)
+		if (buf[pos / 8] & (1 << (pos % 8)))
+			value |= 1 << i;
+	
+	return value;
+}
+
 /*
  * The mirrorfield_crypt_char() function receives a cleartext character
  * and traverses the mirror field to find it's cyphertext equivelent,
  * which is then returned. It also calls mirrorfield_roll_chars() after
  * the cyphertext character is determined.
  */
-unsigned char mirrorfield_crypt_char(unsigned char ch, int debug) {
-	int i, d;
+unsigned char mirrorfield_crypt_char(struct mirrorfield *mf, unsigned char ch, int debug) {
+	int d = DIR_DOWN;
+	int m = mf->fieldIndex;
 	unsigned char sv, ev, rv;
 	struct gridnode *startnode = NULL;
 	struct gridnode *endnode = NULL;
-	static int m = 0;
 	
 	// Get starting node
-	for (i = 0; i < GRID_SIZE * 4; ++i) {
-		if (perimeter[m][i].value == (int)ch) {
-			startnode = &perimeter[m][i];
-			break;
-		}
-	}
+	startnode = &mf->perimeter[m][mf->position[m][ch]];
 	
 	// Set initial direction
 	if (startnode->down != NULL) {
@@ -239,7 +378,9 @@ unsigned char mirrorfield_crypt_char(unsigned char ch, int debug) {
 	}
 	
 	// Traverse the mirror field and find the cyphertext node
-	endnode = mirrorfield_crypt_char_advance(startnode, d, m, debug);
+	PROFILE_PUSH(PROFILE_TRAVERSAL);
+	endnode = mirrorfield_crypt_char_advance(mf, startnode, d, m, debug);
+	PROFILE_POP();
 	
 	// Store start/end values before we roll them
 	sv = startnode->value;
@@ -247,58 +388,85 @@ unsigned char mirrorfield_crypt_char(unsigned char ch, int debug) {
 	rv = ev;
 	
 	// Roll start and end values
-	mirrorfield_roll_chars(sv, ev, m);
+	PROFILE_PUSH(PROFILE_ROLL);
+	mirrorfield_roll_chars(mf, sv, ev, m);
+	PROFILE_POP();
 	
 	// This is a way of returning the cleartext char as the cyphertext
 	// char and still preserve decryption.
-	if (perimeter[m][(ev+sv)%(GRID_SIZE*4)].value == (ev+sv)%(GRID_SIZE*4)) {
+	if (mf->perimeter[m][(ev+sv)%(GRID_SIZE*4)].value == (ev+sv)%(GRID_SIZE*4)) {
 		rv = sv;
 	}
 	
 	// Cycle mirror field index
-	m = (m + 1) % MIRROR_FIELD_COUNT;
+	mf->fieldIndex = (m + 1) % MIRROR_FIELD_COUNT;
 	
 	return rv;
 }
 
 /*
- * The mirrorfield_crypt_char_advance() is a recursive function that traverses
- * the mirror field and returns a pointer to the node containing the cypthertext
- * character. This function also handles mirror rotation.
+ * The mirrorfield_crypt_byte() function encrypts an 8-bit character by
+ * passing its right and left 4 bits through mirrorfield_crypt_char() and
+ * reassembling the results.
+ */
+unsigned char mirrorfield_crypt_byte(struct mirrorfield *mf, unsigned char ch, int debug) {
+	unsigned char l, r;
+	
+	// Crypt right 4 bits
+	r = mirrorfield_crypt_char(mf, ch & 0x0F, debug);
+	
+	// Crypt left 4 bits
+	l = mirrorfield_crypt_char(mf, ch >> 4, debug);
+	
+	// Assemble right and left results back into a byte
+	return (l << 4) + r;
+}
+
+/*
+ * The mirrorfield_crypt_char_advance() function traverses the mirror field
+ * and returns a pointer to the node containing the cypthertext character.
+ * This function also handles mirror rotation. Every mirror passed on the
+ * way is rotated once the cyphertext node is found.
  */
-static struct gridnode *mirrorfield_crypt_char_advance(struct gridnode *p, int d, int m, int debug) {
-	struct gridnode *t;
+static struct gridnode *mirrorfield_crypt_char_advance(struct mirrorfield *mf, struct gridnode *p, int d, int m, int debug) {
+	int i;
+	int n = 0;
+	struct gridnode *path[GRID_SIZE * GRID_SIZE * 2];
 	
 	// For the debug flag
 	struct timespec ts;
 	ts.tv_sec = debug / 1000;
 	ts.tv_nsec = (debug % 1000) * 1000000;
-	if (debug) {
-		mirrorfield_draw(p, m);
-		fflush(stdout);
-		nanosleep(&ts, NULL);
-	}
 
-	// Advance character
-	switch (d) {
-		case DIR_DOWN:
-			p = p->down;
-			break;
-		case DIR_LEFT:
-			p = p->left;
-			break;
-		case DIR_RIGHT:
-			p = p->right;
-			break;
-		case DIR_UP:
-			p = p->up;
-			break;
-	}
-	
-	// If we don't have the cypthertext, determine new direction and perform
-	// a recursive call.
-	if (p->value < 0) {
+	for (;;) {
+		if (debug) {
+			mirrorfield_draw(mf, p, m);
+			fflush(stdout);
+			nanosleep(&ts, NULL);
+		}
 
+		// Advance character
+		switch (d) {
+			case DIR_DOWN:
+				p = p->down;
+				break;
+			case DIR_LEFT:
+				p = p->left;
+				break;
+			case DIR_RIGHT:
+				p = p->right;
+				break;
+			case DIR_UP:
+				p = p->up;
+				break;
+		}
+		
+		// Stop when we have the cyphertext
+		if (p->value >= 0)
+			break;
+		
+		// Remember the mirror and determine new direction
+		path[n++] = p;
 		switch (p->value) {
 			case MIRROR_FORWARD:
 				switch (d) {
@@ -332,27 +500,22 @@ static struct gridnode *mirrorfield_crypt_char_advance(struct gridnode *p, int d
 						break;
 				}
 				break;
-				
 		}
-		
-		// Perform recursive call. t will be our cyphertext node.
-		t = mirrorfield_crypt_char_advance(p, d, m, debug);
-		
-		// Rotate mirror after we get cyphertext
-		switch (p->value) {
+	}
+	
+	// Rotate mirrors after we get cyphertext
+	for (i = 0; i < n; ++i) {
+		switch (path[i]->value) {
 			case MIRROR_FORWARD:
-				p->value = MIRROR_STRAIGHT;
+				path[i]->value = MIRROR_STRAIGHT;
 				break;
 			case MIRROR_BACKWARD:
-				p->value = MIRROR_FORWARD;
+				path[i]->value = MIRROR_FORWARD;
 				break;
 			case MIRROR_STRAIGHT:
-				p->value = MIRROR_BACKWARD;
+				path[i]->value = MIRROR_BACKWARD;
 				break;
 		}
-		
-		// After rotating mirror at p, assign it the cyphertext node.
-		p = t;
 	}
 	
 	// Return cyphertext node
@@ -365,14 +528,13 @@ static struct gridnode *mirrorfield_crypt_char_advance(struct gridnode *p, int d
  * implements a character rolling process to reposition the nodes and
  * increase randomness in the output. No value is returned.
  */
-static void mirrorfield_roll_chars(int s, int e, int m) {
+static void mirrorfield_roll_chars(struct mirrorfield *mf, int s, int e, int m) {
 	int i, t, x1, x2;
-	static int g1 = 0;
-	static int g2 = GRID_SIZE * 2;
-	static int c = 0;
+	int g1 = mf->rollIndex1;
+	int g2 = mf->rollIndex2;
 
 	// Get rotate order
-	if (perimeter[m][s].value > perimeter[m][e].value) {
+	if (mf->perimeter[m][s].value > mf->perimeter[m][e].value) {
 		x1 = s;
 		x2 = e;
 	} else {
@@ -381,26 +543,30 @@ static void mirrorfield_roll_chars(int s, int e, int m) {
 	}
 
 	// Get perimeter index for value x1
-	for (i = 0; perimeter[m][i].value != x1; ++i);
-		;
+	i = mf->position[m][x1];
+
 	// Rotate x1 to new position.
-	t = perimeter[m][i].value;
-	perimeter[m][i].value = perimeter[m][g1].value;
-	perimeter[m][g1].value = t;
+	t = mf->perimeter[m][i].value;
+	mf->perimeter[m][i].value = mf->perimeter[m][g1].value;
+	mf->perimeter[m][g1].value = t;
+	mf->position[m][mf->perimeter[m][i].value] = i;
+	mf->position[m][t] = g1;
 	
 	// Get perimeter index for value x2
-	for (i = 0; perimeter[m][i].value != x2; ++i);
-		;
-	// Rotate x1 to new position.
-	t = perimeter[m][i].value;
-	perimeter[m][i].value = perimeter[m][g2].value;
-	perimeter[m][g2].value = t;
+	i = mf->position[m][x2];
+
+	// Rotate x2 to new position.
+	t = mf->perimeter[m][i].value;
+	mf->perimeter[m][i].value = mf->perimeter[m][g2].value;
+	mf->perimeter[m][g2].value = t;
+	mf->position[m][mf->perimeter[m][i].value] = i;
+	mf->position[m][t] = g2;
 	
 	// The g holds the roll position
-	if (++c == MIRROR_FIELD_COUNT) {
-		g1 = (g1 + 1) % (GRID_SIZE * 4);
-		g2 = (g2 + 1) % (GRID_SIZE * 4);
-		c = 0;
+	if (++mf->rollCount == MIRROR_FIELD_COUNT) {
+		mf->rollIndex1 = (g1 + 1) % (GRID_SIZE * 4);
+		mf->rollIndex2 = (g2 + 1) % (GRID_SIZE * 4);
+		mf->rollCount = 0;
 	}
 	
 	return;
@@ -411,7 +577,7 @@ static void mirrorfield_roll_chars(int s, int e, int m) {
  * field and perimeter characters. It receives x/y coordinates and highlights
  * that position on the field.
  */
-static void mirrorfield_draw(struct gridnode *p, int m) {
+static void mirrorfield_draw(struct mirrorfield *mf, struct gridnode *p, int m) {
 	int r, c;
 	static int resetCursor = 0;
 	
@@ -430,7 +596,7 @@ static void mirrorfield_draw(struct gridnode *p, int m) {
 		for (c = -1; c <= GRID_SIZE; ++c) {
 
 			// Highlight cell if r/c match
-			if (r >= 0 && r < GRID_SIZE && c >= 0 && c < GRID_SIZE && &gridnodes[m][(r * GRID_SIZE) + c] == p) {
+			if (r >= 0 && r < GRID_SIZE && c >= 0 && c < GRID_SIZE && &mf->gridnodes[m][(r * GRID_SIZE) + c] == p) {
 				printf("\x1B[30m"); // foreground black
 				printf("\x1B[47m"); // background white
 			}
@@ -445,25 +611,25 @@ static void mirrorfield_draw(struct gridnode *p, int m) {
 			} else if (r == GRID_SIZE && c == GRID_SIZE) {   // Lower right corner
 				printf("%2c", ' ');
 			} else if (r == -1) {                            // Top chars
-				printf("%2x", gridnodes[m][c].up->value);
+				printf("%2x", mf->perimeter[m][c].value);
 			} else if (c == GRID_SIZE) {                     // Right chars
-				printf("%2x", gridnodes[m][(r * GRID_SIZE) + (GRID_SIZE-1)].right->value);
+				printf("%2x", mf->perimeter[m][r + GRID_SIZE].value);
 			} else if (r == GRID_SIZE) {                     // Bottom chars
-				printf("%2x", gridnodes[m][c + (GRID_SIZE * 3)].down->value);
+				printf("%2x", mf->perimeter[m][c + (GRID_SIZE * 2)].value);
 			} else if (c == -1) {                            // Left chars
-				printf("%2x", gridnodes[m][r * GRID_SIZE].left->value);
-			} else if (gridnodes[m][(r * GRID_SIZE) + c].value == MIRROR_FORWARD) {
+				printf("%2x", mf->perimeter[m][r + (GRID_SIZE * 3)].value);
+			} else if (mf->gridnodes[m][(r * GRID_SIZE) + c].value == MIRROR_FORWARD) {
 				printf("%2c", '/');
-			} else if (gridnodes[m][(r * GRID_SIZE) + c].value == MIRROR_BACKWARD) {
+			} else if (mf->gridnodes[m][(r * GRID_SIZE) + c].value == MIRROR_BACKWARD) {
 				printf("%2c", '\\');
-			} else if (gridnodes[m][(r * GRID_SIZE) + c].value == MIRROR_STRAIGHT) {
+			} else if (mf->gridnodes[m][(r * GRID_SIZE) + c].value == MIRROR_STRAIGHT) {
 				printf("%2c", '-');
 			} else {
 				printf("%2c", ' ');
 			}
 
 			// Un-Highlight cell if r/c match
-			if (r >= 0 && r < GRID_SIZE && c >= 0 && c < GRID_SIZE && &gridnodes[m][(r * GRID_SIZE) + c] == p)
+			if (r >= 0 && r < GRID_SIZE && c >= 0 && c < GRID_SIZE && &mf->gridnodes[m][(r * GRID_SIZE) + c] == p)
 				printf("\x1B[0m");
 
 		}
@@ -6,13 +6,67 @@
 #ifndef MIRRORFIELD_H
 #define MIRRORFIELD_H 1
 
+#include "main.h"
+
+/*
+ * Number of bits needed to store one perimeter character when a mirror
+ * field is packed with mirrorfield_pack().
+ */
+#if GRID_SIZE * 4 <= 16
+#define MIRRORFIELD_PERIMETER_BITS 4
+#else
+#define MIRRORFIELD_PERIMETER_BITS 8
+#endif
+
+/*
+ * Size in bytes of a mirror field packed with mirrorfield_pack(). Mirrors
+ * take 2 bits each, perimeter characters MIRRORFIELD_PERIMETER_BITS bits
+ * each, and the four counters one byte each.
+ */
+#define MIRRORFIELD_PACKED_SIZE (((MIRROR_FIELD_COUNT * GRID_SIZE * GRID_SIZE * 2) + (MIRROR_FIELD_COUNT * GRID_SIZE * 4 * MIRRORFIELD_PERIMETER_BITS) + 7) / 8 + 4)
+
+/*
+ * Mirror Field Node Definition
+ */
+struct gridnode {
+	int value;
+	struct gridnode *up;
+	struct gridnode *down;
+	struct gridnode *left;
+	struct gridnode *right;
+};
+
+/*
+ * Mirror Field State Definition
+ * 
+ * Holds everything the algorithm needs to encrypt a stream: the mirror
+ * fields, their perimeter characters, and the counters that advance as
+ * characters are processed. Each independent stream needs its own copy.
+ * The position map, from perimeter character to perimeter index, is
+ * built by mirrorfield_link() and kept current as characters roll.
+ */
+struct mirrorfield {
+	struct gridnode gridnodes[MIRROR_FIELD_COUNT][GRID_SIZE * GRID_SIZE];
+	struct gridnode perimeter[MIRROR_FIELD_COUNT][GRID_SIZE * 4];
+	int position[MIRROR_FIELD_COUNT][GRID_SIZE * 4];
+	int setIndex;
+	int fieldIndex;
+	int rollIndex1;
+	int rollIndex2;
+	int rollCount;
+};
+
 /*
  * Function Prototypes
  */
-void mirrorfield_init(void);
-int  mirrorfield_set(unsigned char);
-int  mirrorfield_validate(void);
-void mirrorfield_link(void);
-unsigned char mirrorfield_crypt_char(unsigned char, int);
+void mirrorfield_init(struct mirrorfield *);
+int  mirrorfield_set(struct mirrorfield *, unsigned char);
+int  mirrorfield_validate(struct mirrorfield *);
+void mirrorfield_link(struct mirrorfield *);
+void mirrorfield_clone(struct mirrorfield *, const struct mirrorfield *);
+void mirrorfield_pack(const struct mirrorfield *, unsigned char *);
+int  mirrorfield_unpack(struct mirrorfield *, const unsigned char *);
+unsigned char mirrorfield_crypt_char(struct mirrorfield *, unsigned char, int);
+unsigned char mirrorfield_crypt_byte(struct mirrorfield *, unsigned char, int);
 
 #endif
@@ -0,0 +1,656 @@
+// Copyright (c) 2017 Brian Barto
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GPL License. See LICENSE for more details.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "main.h"
+#include "modules/mirrorfield.h"
+#include "modules/hash.h"
+#include "modules/workers.h"
+#include "modules/pcapfile.h"
+
+/*
+ * MODULE DESCRIPTION
+ * 
+ * The pcapfile module encrypts the payloads of the packets in a pcap or
+ * pcapng capture while leaving the capture format, link, IP, TCP, and UDP
+ * headers untouched, so the result can still be indexed by capture tools.
+ * 
+ * Packets are grouped in to flows by their IP addresses, protocol, and
+ * ports. Each flow gets a mirror field cloned from the key the first time
+ * it is seen, so the payload bytes of a flow are encrypted as one
+ * continuous stream. Running an encrypted capture through again restores
+ * it, because the headers that identify each flow are unchanged.
+ * 
+ * For IP protocols other than TCP and UDP, and for IP fragments that do
+ * not carry the transport header, everything after the IP header is
+ * treated as payload of a flow with zero ports. Non-IP frames are copied
+ * unchanged.
+ * 
+ * Idle flows are kept in the packed form from mirrorfield_pack(), so a
+ * capture with millions of short flows needs little memory. Only the
+ * PCAPFILE_HOT_FLOWS most recently used flows are held unpacked.
+ * 
+ * Records are read in to a batch buffer of up to PCAPFILE_BATCH_SIZE
+ * bytes. Payloads are encrypted in place and never change size, so the
+ * batch is written out as is once its packets are encrypted. With more
+ * than one worker, the batch is shared with worker processes that each
+ * own the flows of one shard of the flow hash. Every worker walks the
+ * whole batch in order and encrypts only the packets of its own flows,
+ * so each flow is still encrypted as one continuous stream.
+ */
+
+#define PCAP_MAGIC          0xA1B2C3D4
+#define PCAP_MAGIC_NSEC     0xA1B23C4D
+#define PCAPNG_SHB          0x0A0D0D0A
+#define PCAPNG_IDB          0x00000001
+#define PCAPNG_SPB          0x00000003
+#define PCAPNG_EPB          0x00000006
+#define PCAPNG_BYTE_ORDER   0x1A2B3C4D
+#define LINKTYPE_ETHERNET   1
+#define LINKTYPE_RAW        101
+#define LINKTYPE_IPV4       228
+#define LINKTYPE_IPV6       229
+#define IPPROTO_TCP_        6
+#define IPPROTO_UDP_        17
+#define FLOWS_INITIAL       1024
+
+/*
+ * Flow Key and Table Definitions
+ */
+struct flowkey {
+	unsigned char src[16];
+	unsigned char dst[16];
+	unsigned char sport[2];
+	unsigned char dport[2];
+	unsigned char proto;
+	unsigned char version;
+};
+
+struct flow {
+	struct flowkey key;
+	unsigned char live;
+	int hot;
+	unsigned char state[MIRRORFIELD_PACKED_SIZE];
+};
+
+struct hotflow {
+	size_t flow;
+	unsigned long used;
+	struct mirrorfield mf;
+};
+
+/*
+ * Batched Packet Definition. The packet is at offset in the batch buffer.
+ */
+struct packet {
+	size_t offset;
+	size_t caplen;
+	uint32_t linktype;
+};
+
+// Static Variables
+static struct flow *flows;
+static size_t flowSize;
+static size_t flowCount;
+static struct hotflow *hot;
+static int hotCount;
+static unsigned long hotTick;
+static const struct mirrorfield *template;
+static int swapped;
+static int flowError;
+static unsigned char *batch;
+static size_t batchLength;
+static struct packet *packets;
+static size_t packetCount;
+static int shard;
+static int shardCount;
+static struct workers pool;
+
+// Static Function Prototypes
+static int  pcapfile_crypt_pcap(FILE *, FILE *, unsigned char *);
+static int  pcapfile_crypt_pcapng(FILE *, FILE *, unsigned char *);
+static void pcapfile_crypt_packet(unsigned char *, size_t, uint32_t);
+static void pcapfile_crypt_ip(unsigned char *, size_t);
+static struct mirrorfield *pcapfile_flow(struct flowkey *);
+static size_t pcapfile_flow_slot(struct flowkey *);
+static unsigned char *pcapfile_reserve(FILE *, size_t);
+static void pcapfile_queue(unsigned char *, size_t, uint32_t);
+static int  pcapfile_flush(FILE *);
+static void pcapfile_worker(int, int, int);
+static uint32_t pcapfile_u32(const unsigned char *);
+static uint32_t pcapfile_be32(const unsigned char *);
+static uint32_t pcapfile_le32(const unsigned char *);
+static uint16_t pcapfile_u16(const unsigned char *);
+
+/*
+ * The pcapfile_crypt() function reads a pcap or pcapng capture from in,
+ * encrypts the payload of each packet with the mirror field for its flow,
+ * and writes the capture to out. Up to the given number of worker
+ * processes share the encryption. One or fewer encrypts in this process.
+ * 
+ * Zero is returned if the input is not a supported capture or is
+ * truncated, if a record is larger than PCAPFILE_BATCH_SIZE, or if
+ * writing fails.
+ */
+int pcapfile_crypt(FILE *in, FILE *out, const struct mirrorfield *key, int workers) {
+	int r = 0;
+	uint32_t big, little;
+	unsigned char magic[4];
+	
+	setvbuf(in, NULL, _IOFBF, PCAPFILE_BUFFER_SIZE);
+	setvbuf(out, NULL, _IOFBF, PCAPFILE_BUFFER_SIZE);
+	
+	if (workers > WORKERS_MAX)
+		workers = WORKERS_MAX;
+	if (workers < 2)
+		workers = 1;
+	
+	// Create flow table and batch buffers, shared with workers
+	template = key;
+	flowSize = FLOWS_INITIAL;
+	flowCount = 0;
+	hotCount = 0;
+	flowError = 0;
+	batchLength = 0;
+	packetCount = 0;
+	shard = 0;
+	shardCount = workers;
+	pool.count = 0;
+	flows = calloc(flowSize, sizeof(struct flow));
+	hot = malloc(PCAPFILE_HOT_FLOWS * sizeof(struct hotflow));
+	batch = mmap(NULL, PCAPFILE_BATCH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	packets = mmap(NULL, PCAPFILE_BATCH_PACKETS * sizeof(struct packet), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	
+	if (flows != NULL && hot != NULL && batch != MAP_FAILED && packets != MAP_FAILED && (workers == 1 || workers_start(&pool, workers, pcapfile_worker))) {
+
+		// Detect file format and byte order from the magic number. The
+		// pcapng block type reads the same in either byte order. Anything
+		// else is not a supported capture.
+		if (fread(magic, 1, 4, in) == 4) {
+			big = pcapfile_be32(magic);
+			little = pcapfile_le32(magic);
+			if (big == PCAPNG_SHB) {
+				r = pcapfile_crypt_pcapng(in, out, magic);
+			} else if (big == PCAP_MAGIC || big == PCAP_MAGIC_NSEC) {
+				swapped = 0;
+				r = pcapfile_crypt_pcap(in, out, magic);
+			} else if (little == PCAP_MAGIC || little == PCAP_MAGIC_NSEC) {
+				swapped = 1;
+				r = pcapfile_crypt_pcap(in, out, magic);
+			}
+		}
+		
+		workers_stop(&pool);
+	}
+	
+	// Free flow table and batch buffers
+	free(flows);
+	free(hot);
+	if (batch != MAP_FAILED)
+		munmap(batch, PCAPFILE_BATCH_SIZE);
+	if (packets != MAP_FAILED)
+		munmap(packets, PCAPFILE_BATCH_PACKETS * sizeof(struct packet));
+	flows = NULL;
+	hot = NULL;
+	
+	if (fflush(out) != 0)
+		return 0;
+
+	return r;
+}
+
+/*
+ * The pcapfile_worker() function is the main loop of the worker process
+ * that encrypts the flows of the given shard. For each packet count read
+ * from the command pipe it encrypts the packets of its shard in the
+ * shared batch and answers on the result pipe with a zero byte, or a one
+ * byte if a flow could not be allocated. It returns when the command
+ * pipe is closed.
+ */
+static void pcapfile_worker(int index, int cmd, int result) {
+	size_t i, count;
+	unsigned char status;
+	
+	shard = index;
+	
+	while (read(cmd, &count, sizeof(count)) == sizeof(count)) {
+		for (i = 0; i < count; ++i)
+			pcapfile_crypt_packet(batch + packets[i].offset, packets[i].caplen, packets[i].linktype);
+		
+		status = flowError;
+		if (write(result, &status, 1) != 1)
+			break;
+	}
+}
+
+/*
+ * The pcapfile_crypt_pcap() function processes a classic pcap capture.
+ * The magic number has already been read and the byte order determined.
+ */
+static int pcapfile_crypt_pcap(FILE *in, FILE *out, unsigned char *magic) {
+	size_t n, caplen;
+	uint32_t linktype;
+	unsigned char header[24];
+	unsigned char *record;
+	
+	// Copy the file header
+	memcpy(header, magic, 4);
+	if (fread(header + 4, 1, 20, in) != 20 || fwrite(header, 1, 24, out) != 24)
+		return 0;
+	linktype = pcapfile_u32(header + 20) & 0x0FFFFFFF;
+	
+	// Queue each packet record
+	while ((n = fread(header, 1, 16, in)) == 16) {
+		caplen = pcapfile_u32(header + 8);
+		if ((record = pcapfile_reserve(out, 16 + caplen)) == NULL)
+			return 0;
+
+		memcpy(record, header, 16);
+		if (fread(record + 16, 1, caplen, in) != caplen)
+			return 0;
+
+		batchLength += 16 + caplen;
+		pcapfile_queue(record + 16, caplen, linktype);
+	}
+	
+	return n == 0 && feof(in) && pcapfile_flush(out);
+}
+
+/*
+ * The pcapfile_crypt_pcapng() function processes a pcapng capture. Each
+ * section may have its own byte order and interfaces, so the interface
+ * link types are collected from the interface description blocks of the
+ * current section. Enhanced and simple packet blocks are encrypted, all
+ * other blocks are copied unchanged.
+ */
+static int pcapfile_crypt_pcapng(FILE *in, FILE *out, unsigned char *magic) {
+	size_t length, caplen, offset;
+	size_t interfaceCount = 0;
+	uint32_t type, linktype;
+	uint32_t *interfaces = NULL;
+	unsigned char head[12];
+	unsigned char *block;
+	
+	// The first block type is the magic number, which was already read
+	memcpy(head, magic, 4);
+
+	for (;;) {
+		type = pcapfile_u32(head);
+		
+		// New section. Determine its byte order and forget interfaces.
+		if (type == PCAPNG_SHB) {
+			if (fread(head + 4, 1, 8, in) != 8)
+				break;
+			if (pcapfile_be32(head + 8) == PCAPNG_BYTE_ORDER)
+				swapped = 0;
+			else if (pcapfile_le32(head + 8) == PCAPNG_BYTE_ORDER)
+				swapped = 1;
+			else
+				break;
+			interfaceCount = 0;
+			offset = 12;
+		} else {
+			if (fread(head + 4, 1, 4, in) != 4)
+				break;
+			offset = 8;
+		}
+		
+		// Read the rest of the block in to the batch
+		length = pcapfile_u32(head + 4);
+		if (length < offset + 4 || length % 4 != 0)
+			break;
+		if ((block = pcapfile_reserve(out, length)) == NULL)
+			break;
+		memcpy(block, head, offset);
+		if (fread(block + offset, 1, length - offset, in) != length - offset)
+			break;
+		batchLength += length;
+
+		// Record interface link type
+		if (type == PCAPNG_IDB && length >= 20) {
+			if ((interfaces = realloc(interfaces, (interfaceCount + 1) * sizeof(uint32_t))) == NULL)
+				break;
+			interfaces[interfaceCount++] = pcapfile_u16(block + 8);
+		}
+		
+		// Queue enhanced packet
+		else if (type == PCAPNG_EPB && length >= 32) {
+			caplen = pcapfile_u32(block + 20);
+			if (pcapfile_u32(block + 8) < interfaceCount && caplen <= length - 32) {
+				linktype = interfaces[pcapfile_u32(block + 8)];
+				pcapfile_queue(block + 28, caplen, linktype);
+			}
+		}
+		
+		// Queue simple packet, which always belongs to the first interface
+		else if (type == PCAPNG_SPB && length >= 16 && interfaceCount > 0) {
+			caplen = pcapfile_u32(block + 8);
+			if (caplen > length - 16)
+				caplen = length - 16;
+			pcapfile_queue(block + 12, caplen, interfaces[0]);
+		}
+		
+		// Read the next block type
+		if ((length = fread(head, 1, 4, in)) != 4) {
+			free(interfaces);
+			return length == 0 && feof(in) && pcapfile_flush(out);
+		}
+	}
+	
+	free(interfaces);
+
+	return 0;
+}
+
+/*
+ * The pcapfile_crypt_packet() function locates the IP packet within a
+ * captured frame of the given link type and passes it on for encryption.
+ */
+static void pcapfile_crypt_packet(unsigned char *packet, size_t caplen, uint32_t linktype) {
+	size_t offset = 12;
+	uint16_t ethertype;
+
+	switch (linktype) {
+		case LINKTYPE_ETHERNET:
+			if (caplen < 14)
+				return;
+			
+			// Skip VLAN tags
+			ethertype = (packet[offset] << 8) | packet[offset + 1];
+			while ((ethertype == 0x8100 || ethertype == 0x88A8) && caplen >= offset + 8) {
+				offset += 4;
+				ethertype = (packet[offset] << 8) | packet[offset + 1];
+			}
+			
+			if (ethertype == 0x0800 || ethertype == 0x86DD)
+				pcapfile_crypt_ip(packet + offset + 2, caplen - offset - 2);
+			break;
+		case LINKTYPE_RAW:
+		case LINKTYPE_IPV4:
+		case LINKTYPE_IPV6:
+			pcapfile_crypt_ip(packet, caplen);
+			break;
+	}
+}
+
+/*
+ * The pcapfile_crypt_ip() function finds the flow and payload of an IPv4
+ * or IPv6 packet and encrypts the payload with the flow's mirror field.
+ */
+static void pcapfile_crypt_ip(unsigned char *ip, size_t caplen) {
+	size_t i, length, offset;
+	int fragment = 0;
+	struct flowkey key;
+	struct mirrorfield *mf;
+	
+	memset(&key, 0, sizeof(key));
+	
+	if (caplen < 1)
+		return;
+	key.version = ip[0] >> 4;
+	
+	// IPv4 header
+	if (key.version == 4) {
+		if (caplen < 20 || (ip[0] & 0x0F) < 5)
+			return;
+		offset = (ip[0] & 0x0F) * 4;
+		length = (ip[2] << 8) | ip[3];
+		key.proto = ip[9];
+		memcpy(key.src, ip + 12, 4);
+		memcpy(key.dst, ip + 16, 4);
+		fragment = (((ip[6] & 0x1F) << 8) | ip[7]) != 0;
+	}
+	
+	// IPv6 header and extension headers
+	else if (key.version == 6) {
+		if (caplen < 40)
+			return;
+		offset = 40;
+		length = 40 + ((ip[4] << 8) | ip[5]);
+		key.proto = ip[6];
+		memcpy(key.src, ip + 8, 16);
+		memcpy(key.dst, ip + 24, 16);
+		while ((key.proto == 0 || key.proto == 43 || key.proto == 44 || key.proto == 60) && caplen >= offset + 8) {
+			if (key.proto == 44) {
+				fragment = (((ip[offset + 2] << 8) | ip[offset + 3]) & 0xFFF8) != 0;
+				key.proto = ip[offset];
+				offset += 8;
+			} else {
+				key.proto = ip[offset];
+				offset += (ip[offset + 1] + 1) * 8;
+			}
+		}
+	}
+
+	else {
+		return;
+	}
+	
+	// Ignore any link layer padding after the IP packet. A length that is
+	// too short to be real, as seen in captures of offloaded packets, is
+	// ignored instead.
+	if (length >= offset && length < caplen)
+		caplen = length;
+	
+	// Skip the transport header and record the ports
+	if (!fragment && key.proto == IPPROTO_TCP_) {
+		if (caplen < offset + 20 || (ip[offset + 12] >> 4) < 5)
+			return;
+		memcpy(key.sport, ip + offset, 2);
+		memcpy(key.dport, ip + offset + 2, 2);
+		offset += (ip[offset + 12] >> 4) * 4;
+	} else if (!fragment && key.proto == IPPROTO_UDP_) {
+		if (caplen < offset + 8)
+			return;
+		memcpy(key.sport, ip + offset, 2);
+		memcpy(key.dport, ip + offset + 2, 2);
+		offset += 8;
+	}
+	
+	if (caplen <= offset)
+		return;
+	
+	// Leave flows of other shards to their workers. The shard is taken
+	// from the high bits of the hash, as the table slot uses the low bits.
+	if (shardCount > 1 && ((uint64_t)hash_fnv1a(&key, sizeof(key)) * shardCount) >> 32 != (uint64_t)shard)
+		return;
+	
+	// Encrypt the payload
+	if ((mf = pcapfile_flow(&key)) == NULL)
+		return;
+	for (i = offset; i < caplen; ++i)
+		ip[i] = mirrorfield_crypt_byte(mf, ip[i], 0);
+}
+
+/*
+ * The pcapfile_flow() function returns the mirror field for a flow,
+ * cloning a new one from the key if the flow has not been seen before.
+ * Flows are kept in an open addressing hash table that doubles in size
+ * when it becomes half full. The flow is unpacked in to the hot flow
+ * cache if it is not already there, packing the least recently used hot
+ * flow back in to its table entry to make room.
+ * 
+ * NULL is returned if memory can not be allocated, and flowError is set.
+ */
+static struct mirrorfield *pcapfile_flow(struct flowkey *key) {
+	int h;
+	size_t i, j;
+	struct flow *old;
+	
+	// Grow the table
+	if (flowCount * 2 >= flowSize) {
+		old = flows;
+		if ((flows = calloc(flowSize * 2, sizeof(struct flow))) == NULL) {
+			flows = old;
+			flowError = 1;
+			return NULL;
+		}
+		flowSize *= 2;
+		for (i = 0; i < flowSize / 2; ++i) {
+			if (old[i].live) {
+				j = pcapfile_flow_slot(&old[i].key);
+				flows[j] = old[i];
+				if (flows[j].hot != -1)
+					hot[flows[j].hot].flow = j;
+			}
+		}
+		free(old);
+	}
+	
+	j = pcapfile_flow_slot(key);
+	
+	if (flows[j].live && flows[j].hot != -1) {
+		hot[flows[j].hot].used = ++hotTick;
+		return &hot[flows[j].hot].mf;
+	}
+	
+	// Make room in the hot flow cache
+	if (hotCount < PCAPFILE_HOT_FLOWS) {
+		h = hotCount++;
+	} else {
+		for (h = 0, i = 1; i < PCAPFILE_HOT_FLOWS; ++i)
+			if (hot[i].used < hot[h].used)
+				h = i;
+		mirrorfield_pack(&hot[h].mf, flows[hot[h].flow].state);
+		flows[hot[h].flow].hot = -1;
+	}
+	
+	// New flow, or idle flow
+	if (!flows[j].live) {
+		flows[j].key = *key;
+		flows[j].live = 1;
+		mirrorfield_clone(&hot[h].mf, template);
+		++flowCount;
+	} else if (mirrorfield_unpack(&hot[h].mf, flows[j].state) == 0) {
+		flowError = 1;
+		return NULL;
+	}
+	
+	flows[j].hot = h;
+	hot[h].flow = j;
+	hot[h].used = ++hotTick;
+	
+	return &hot[h].mf;
+}
+
+/*
+ * The pcapfile_flow_slot() function returns the index of the table slot
+ * that holds the flow, or of the empty slot where it belongs.
+ */
+static size_t pcapfile_flow_slot(struct flowkey *key) {
+	size_t j;
+
+	for (j = hash_fnv1a(key, sizeof(struct flowkey)) % flowSize; flows[j].live; j = (j + 1) % flowSize)
+		if (memcmp(&flows[j].key, key, sizeof(struct flowkey)) == 0)
+			break;
+	
+	return j;
+}
+
+/*
+ * The pcapfile_reserve() function returns the place in the batch buffer
+ * for a record of n bytes. If the record or its packet does not fit, the
+ * batch is flushed first. The caller adds n to batchLength once the
+ * record is read.
+ * 
+ * NULL is returned if the record is larger than PCAPFILE_BATCH_SIZE or
+ * the flush fails.
+ */
+static unsigned char *pcapfile_reserve(FILE *out, size_t n) {
+	if (n > PCAPFILE_BATCH_SIZE)
+		return NULL;
+
+	if (batchLength + n > PCAPFILE_BATCH_SIZE || packetCount == PCAPFILE_BATCH_PACKETS)
+		if (pcapfile_flush(out) == 0)
+			return NULL;
+	
+	return batch + batchLength;
+}
+
+/*
+ * The pcapfile_queue() function adds a packet in the batch buffer to the
+ * list of packets to encrypt when the batch is flushed.
+ */
+static void pcapfile_queue(unsigned char *packet, size_t caplen, uint32_t linktype) {
+	packets[packetCount].offset = packet - batch;
+	packets[packetCount].caplen = caplen;
+	packets[packetCount].linktype = linktype;
+	++packetCount;
+}
+
+/*
+ * The pcapfile_flush() function encrypts the packets of the batch, in
+ * this process or by handing the batch to every worker and waiting for
+ * each to finish, then writes the batch to out and empties it.
+ * 
+ * Zero is returned if a worker or a flow failed, or if writing fails.
+ */
+static int pcapfile_flush(FILE *out) {
+	int i;
+	size_t n;
+	unsigned char status;
+	
+	if (shardCount == 1) {
+		for (n = 0; n < packetCount; ++n)
+			pcapfile_crypt_packet(batch + packets[n].offset, packets[n].caplen, packets[n].linktype);
+	} else {
+		for (i = 0; i < shardCount; ++i)
+			if (write(pool.cmds[i], &packetCount, sizeof(packetCount)) != sizeof(packetCount))
+				return 0;
+		for (i = 0; i < shardCount; ++i)
+			if (read(pool.results[i], &status, 1) != 1 || status != 0)
+				return 0;
+	}
+	
+	if (flowError || fwrite(batch, 1, batchLength, out) != batchLength)
+		return 0;
+	
+	batchLength = 0;
+	packetCount = 0;
+	
+	return 1;
+}
+
+/*
+ * The pcapfile_u32() function reads a 32 bit value in the byte order of
+ * the capture.
+ */
+static uint32_t pcapfile_u32(const unsigned char *p) {
+	if (swapped)
+		return pcapfile_le32(p);
+	else
+		return pcapfile_be32(p);
+}
+
+/*
+ * The pcapfile_be32() function reads a big endian 32 bit value.
+ */
+static uint32_t pcapfile_be32(const unsigned char *p) {
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/*
+ * The pcapfile_le32() function reads a little endian 32 bit value.
+ */
+static uint32_t pcapfile_le32(const unsigned char *p) {
+	return ((uint32_t)p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+/*
+ * The pcapfile_u16() function reads a 16 bit value in the byte order of
+ * the capture.
+ */
+static uint16_t pcapfile_u16(const unsigned char *p) {
+	if (swapped)
+		return (p[1] << 8) | p[0];
+	else
+		return (p[0] << 8) | p[1];
+}
@@ -0,0 +1,39 @@
+// Copyright (c) 2017 Brian Barto
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GPL License. See LICENSE for more details.
+
+#ifndef PCAPFILE_H
+#define PCAPFILE_H 1
+
+#include <stdio.h>
+#include "modules/mirrorfield.h"
+
+/*
+ * Size in bytes of the stdio buffers used to read and write captures.
+ */
+#define PCAPFILE_BUFFER_SIZE   1048576
+
+/*
+ * Size in bytes of the batch of capture records that is encrypted at a
+ * time. This is also the largest record that can be processed.
+ */
+#define PCAPFILE_BATCH_SIZE    4194304
+
+/*
+ * Maximum number of packets in a batch.
+ */
+#define PCAPFILE_BATCH_PACKETS 65536
+
+/*
+ * Number of flows kept unpacked and ready to encrypt. Other flows are
+ * kept packed.
+ */
+#define PCAPFILE_HOT_FLOWS     256
+
+/*
+ * Function Prototypes
+ */
+int  pcapfile_crypt(FILE *, FILE *, const struct mirrorfield *, int);
+
+#endif
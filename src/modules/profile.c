@@ -0,0 +1,169 @@
+// Copyright (c) 2017 Brian Barto
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GPL License. See LICENSE for more details.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "modules/profile.h"
+
+/*
+ * MODULE DESCRIPTION
+ * 
+ * The profile module is a sampling profiler that can be armed inside
+ * mrrcrypt. Code marks the pipeline stage it is in with PROFILE_PUSH()
+ * and PROFILE_POP(), which only shift a tag in to or out of a single
+ * integer. A SIGPROF timer fires at the chosen rate of CPU time and the
+ * handler counts one sample for the current stage stack.
+ * 
+ * At exit the counts are written in the folded stack format used by
+ * flame graph tools, one line per stack, such as:
+ * 
+ *     mrrcrypt;crypt;traversal 1234
+ * 
+ * A forked worker process calls profile_fork() to restart sampling for
+ * itself, because the timer is not inherited, and writes its own counts
+ * to the profile file name with its process id appended. The folded
+ * files of all processes can be concatenated for a combined profile.
+ */
+
+volatile sig_atomic_t profileStack = 0;
+
+// Static Variables
+static unsigned long samples[PROFILE_SLOTS];
+static char *profileFile;
+static struct itimerval interval;
+static const char *stageNames[] = {
+	"unknown", "key_load", "read", "crypt", "traversal", "roll", "write", "base64"
+};
+
+// Static Function Prototypes
+static void profile_sample(int);
+
+/*
+ * The profile_start() function starts sampling at rate samples per second
+ * and arranges for the folded stacks to be written to the named file when
+ * the program exits.
+ * 
+ * Zero is returned upon any errors.
+ */
+int profile_start(char *file, int rate) {
+	struct sigaction sa;
+	
+	if (rate <= 0 || rate > 1000000)
+		return 0;
+
+	profileFile = file;
+	memset(samples, 0, sizeof(samples));
+	
+	// Install sample handler
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = profile_sample;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGPROF, &sa, NULL) == -1)
+		return 0;
+	
+	if (atexit(profile_stop) != 0)
+		return 0;
+	
+	// Start the CPU time interval timer
+	interval.it_interval.tv_sec = 0;
+	interval.it_interval.tv_usec = 1000000 / rate;
+	interval.it_value = interval.it_interval;
+	if (setitimer(ITIMER_PROF, &interval, NULL) == -1)
+		return 0;
+	
+	return 1;
+}
+
+/*
+ * The profile_fork() function is called in a newly forked process. If
+ * the profiler is running, it clears the counts inherited from the parent,
+ * switches to a profile file named after the process id, and restarts the
+ * timer.
+ */
+void profile_fork(void) {
+	char *file;
+	
+	if (profileFile == NULL)
+		return;
+
+	if ((file = malloc(strlen(profileFile) + 24)) == NULL) {
+		profileFile = NULL;
+		return;
+	}
+	sprintf(file, "%s.%ld", profileFile, (long)getpid());
+	profileFile = file;
+
+	memset(samples, 0, sizeof(samples));
+	setitimer(ITIMER_PROF, &interval, NULL);
+}
+
+/*
+ * The profile_sample() function is the SIGPROF handler. It counts one
+ * sample for the current stage stack.
+ */
+static void profile_sample(int sig) {
+	unsigned long stack = profileStack;
+	
+	(void)sig;
+	
+	// Keep only the outermost stages of a stack that is too deep
+	while (stack >= PROFILE_SLOTS)
+		stack >>= PROFILE_TAG_BITS;
+	
+	++samples[stack];
+}
+
+/*
+ * The profile_stop() function stops sampling and writes the counts to
+ * the profile file in folded stack format. It does nothing if the
+ * profiler is not running. It is called at exit, and must be called
+ * directly by a process that leaves with _exit().
+ */
+void profile_stop(void) {
+	int i, d, depth;
+	int tags[PROFILE_MAX_DEPTH];
+	unsigned long stack;
+	char *file;
+	struct itimerval timer;
+	FILE *f;
+	
+	if (profileFile == NULL)
+		return;
+
+	// Stop sampling
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_PROF, &timer, NULL);
+	
+	// Only write once
+	file = profileFile;
+	profileFile = NULL;
+
+	if ((f = fopen(file, "w")) == NULL) {
+		fprintf(stderr, "Could not write profile to %s.\n", file);
+		return;
+	}
+	
+	for (i = 0; i < PROFILE_SLOTS; ++i) {
+		if (samples[i] == 0)
+			continue;
+		
+		// Unpack stage tags, innermost first
+		for (depth = 0, stack = i; stack > 0; stack >>= PROFILE_TAG_BITS)
+			tags[depth++] = stack & ((1 << PROFILE_TAG_BITS) - 1);
+		
+		fprintf(f, "mrrcrypt");
+		for (d = depth - 1; d >= 0; --d)
+			fprintf(f, ";%s", stageNames[tags[d]]);
+		fprintf(f, " %lu\n", samples[i]);
+	}
+	
+	fclose(f);
+}
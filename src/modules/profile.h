@@ -0,0 +1,61 @@
+// Copyright (c) 2017 Brian Barto
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GPL License. See LICENSE for more details.
+
+#ifndef PROFILE_H
+#define PROFILE_H 1
+
+#include <signal.h>
+
+/*
+ * Default number of samples taken per second of CPU time.
+ */
+#define PROFILE_DEFAULT_RATE   997
+
+/*
+ * Pipeline stage tags. Each tag must fit in PROFILE_TAG_BITS bits.
+ */
+#define PROFILE_KEY_LOAD       1
+#define PROFILE_READ           2
+#define PROFILE_CRYPT          3
+#define PROFILE_TRAVERSAL      4
+#define PROFILE_ROLL           5
+#define PROFILE_WRITE          6
+#define PROFILE_BASE64         7
+
+/*
+ * The stage stack is kept in a single integer, PROFILE_TAG_BITS bits per
+ * stage, so that the signal handler can read it in one access. Stacks
+ * deeper than PROFILE_MAX_DEPTH are counted as their outermost stages.
+ */
+#define PROFILE_TAG_BITS       3
+#define PROFILE_MAX_DEPTH      4
+#define PROFILE_SLOTS          (1 << (PROFILE_TAG_BITS * PROFILE_MAX_DEPTH))
+
+/*
+ * The current stage stack. Use the macros below to change it.
+ */
+extern volatile sig_atomic_t profileStack;
+
+/*
+ * Stage tagging is only compiled in when PROFILE_TAGS is defined, which
+ * the Makefile does for the mrrcrypt binary alone. Everywhere else, such
+ * as the library, the macros do nothing and the stack is never written.
+ */
+#ifdef PROFILE_TAGS
+#define PROFILE_PUSH(tag)      (profileStack = (profileStack << PROFILE_TAG_BITS) | (tag))
+#define PROFILE_POP()          (profileStack = profileStack >> PROFILE_TAG_BITS)
+#else
+#define PROFILE_PUSH(tag)      ((void)0)
+#define PROFILE_POP()          ((void)0)
+#endif
+
+/*
+ * Function Prototypes
+ */
+int   profile_start(char *, int);
+void  profile_fork(void);
+void  profile_stop(void);
+
+#endif
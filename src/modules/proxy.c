@@ -0,0 +1,325 @@
+// Copyright (c) 2017 Brian Barto
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GPL License. See LICENSE for more details.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "main.h"
+#include "modules/mirrorfield.h"
+#include "modules/proxy.h"
+
+/*
+ * MODULE DESCRIPTION
+ * 
+ * The proxy module accepts TCP connections and forwards each one to an
+ * upstream address, encrypting the data in both directions on the fly.
+ * Each direction of a connection has its own mirror field cloned from the
+ * key and its own buffer, so the two streams are independent. Because
+ * encryption and decryption are the same operation, two proxies with the
+ * same key can be chained to carry traffic encrypted between them.
+ * 
+ * All sockets are non-blocking and driven by a single epoll loop. The
+ * connection sockets are edge-triggered and on every event both
+ * directions of the connection are pumped until the sockets would block.
+ * The listening socket is level-triggered, so connections left queued
+ * after an accept error are retried on the next pass of the loop. One
+ * spare file descriptor is held in reserve so that, when the process
+ * runs out of descriptors, queued connections can still be accepted and
+ * closed instead of being left to wait.
+ */
+
+/*
+ * Connection State Definitions
+ */
+struct direction {
+	struct mirrorfield mf;
+	unsigned char buffer[PROXY_BUFFER_SIZE];
+	int length;
+	int offset;
+	int eof;
+	int shut;
+};
+
+struct connection;
+
+struct endpoint {
+	struct connection *conn;
+	int fd;
+};
+
+struct connection {
+	struct endpoint client;
+	struct endpoint upstream;
+	struct direction toUpstream;
+	struct direction toClient;
+	int connected;
+	int closed;
+};
+
+// Static Function Prototypes
+static int  proxy_resolve(char *, struct addrinfo **, int);
+static void proxy_accept(int, int, int *, struct addrinfo *, const struct mirrorfield *);
+static int  proxy_handle(struct connection *);
+static int  proxy_pump(struct direction *, int, int);
+static void proxy_close(struct connection *);
+
+/*
+ * The proxy_run() function listens on the listen address and forwards
+ * each connection to the upstream address. Addresses are given as
+ * host:port. It only returns if the proxy can not be started.
+ * 
+ * Zero is returned upon any errors.
+ */
+int proxy_run(char *listenAddress, char *upstreamAddress, const struct mirrorfield *key) {
+	int i, n, epfd, lfd, closed;
+	int on = 1;
+	int spare = open("/dev/null", O_RDONLY);
+	struct connection *finished[PROXY_EVENTS];
+	struct addrinfo *listenInfo, *upstreamInfo;
+	struct epoll_event ev, events[PROXY_EVENTS];
+	struct endpoint *e;
+	
+	// A peer that goes away must not kill the proxy
+	signal(SIGPIPE, SIG_IGN);
+	
+	if (proxy_resolve(listenAddress, &listenInfo, 1) == 0)
+		return 0;
+	if (proxy_resolve(upstreamAddress, &upstreamInfo, 0) == 0)
+		return 0;
+	
+	// Create listening socket
+	if ((lfd = socket(listenInfo->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+		return 0;
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(lfd, listenInfo->ai_addr, listenInfo->ai_addrlen) == -1 || listen(lfd, SOMAXCONN) == -1)
+		return 0;
+	freeaddrinfo(listenInfo);
+	
+	// Create event loop. The listening socket has no endpoint.
+	if ((epfd = epoll_create1(0)) == -1)
+		return 0;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev) == -1)
+		return 0;
+	
+	for (;;) {
+		if ((n = epoll_wait(epfd, events, PROXY_EVENTS, -1)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		
+		for (i = 0, closed = 0; i < n; ++i) {
+			if ((e = events[i].data.ptr) == NULL) {
+				proxy_accept(epfd, lfd, &spare, upstreamInfo, key);
+			} else if (!e->conn->closed && proxy_handle(e->conn) == 0) {
+				proxy_close(e->conn);
+				finished[closed++] = e->conn;
+			}
+		}
+		
+		// Free finished connections once no event in this batch refers to them
+		for (i = 0; i < closed; ++i)
+			free(finished[i]);
+	}
+	
+	return 0;
+}
+
+/*
+ * The proxy_resolve() function looks up a host:port address. Passive
+ * addresses are for listening on.
+ * 
+ * Zero is returned upon any errors.
+ */
+static int proxy_resolve(char *address, struct addrinfo **info, int passive) {
+	int r;
+	char *host, *port;
+	struct addrinfo hints;
+	
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (passive)
+		hints.ai_flags = AI_PASSIVE;
+	
+	// Split host and port, allowing for [host]:port
+	if ((port = strrchr(address, ':')) == NULL)
+		return 0;
+	host = strndup(address, port - address);
+	++port;
+	if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+		memmove(host, host + 1, strlen(host));
+		host[strlen(host) - 1] = '\0';
+	}
+	
+	r = getaddrinfo(*host ? host : NULL, port, &hints, info);
+	free(host);
+
+	return r == 0;
+}
+
+/*
+ * The proxy_accept() function accepts all pending connections, starts
+ * the connection to the upstream address for each, and adds both sockets
+ * to the event loop.
+ * 
+ * When the process is out of file descriptors, the spare descriptor is
+ * closed to accept one queued connection, which is closed at once, and
+ * then reopened. Any other accept error leaves the remaining connections
+ * queued for the next pass of the event loop.
+ */
+static void proxy_accept(int epfd, int lfd, int *spare, struct addrinfo *upstreamInfo, const struct mirrorfield *key) {
+	int cfd, ufd;
+	struct connection *c;
+	struct epoll_event ev;
+	
+	for (;;) {
+		if ((cfd = accept(lfd, NULL, NULL)) == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if ((errno == EMFILE || errno == ENFILE) && *spare != -1) {
+				close(*spare);
+				if ((cfd = accept(lfd, NULL, NULL)) != -1)
+					close(cfd);
+				*spare = open("/dev/null", O_RDONLY);
+				if (cfd != -1)
+					continue;
+			}
+			return;
+		}
+		fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+
+		// Connect to upstream
+		if ((ufd = socket(upstreamInfo->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
+			close(cfd);
+			continue;
+		}
+		if (connect(ufd, upstreamInfo->ai_addr, upstreamInfo->ai_addrlen) == -1 && errno != EINPROGRESS) {
+			close(ufd);
+			close(cfd);
+			continue;
+		}
+		
+		// Create connection with a fresh mirror field for each direction
+		if ((c = malloc(sizeof(struct connection))) == NULL) {
+			close(ufd);
+			close(cfd);
+			continue;
+		}
+		memset(c, 0, sizeof(struct connection));
+		c->client.conn = c;
+		c->client.fd = cfd;
+		c->upstream.conn = c;
+		c->upstream.fd = ufd;
+		mirrorfield_clone(&c->toUpstream.mf, key);
+		mirrorfield_clone(&c->toClient.mf, key);
+
+		// Watch both sockets for everything from now on
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = &c->client;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &ev);
+		ev.data.ptr = &c->upstream;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, ufd, &ev);
+	}
+}
+
+/*
+ * The proxy_handle() function advances a connection after an event on
+ * either of its sockets. Once the upstream connection is established,
+ * both directions are pumped.
+ * 
+ * Zero is returned when the connection is finished or has failed.
+ */
+static int proxy_handle(struct connection *c) {
+	int err = 0;
+	socklen_t len = sizeof(err);
+	struct sockaddr_storage addr;
+	
+	// Wait for the upstream connection
+	if (!c->connected) {
+		if (getsockopt(c->upstream.fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0)
+			return 0;
+		len = sizeof(addr);
+		if (getpeername(c->upstream.fd, (struct sockaddr *)&addr, &len) == -1)
+			return errno == ENOTCONN;
+		c->connected = 1;
+	}
+	
+	if (proxy_pump(&c->toUpstream, c->client.fd, c->upstream.fd) == 0)
+		return 0;
+	if (proxy_pump(&c->toClient, c->upstream.fd, c->client.fd) == 0)
+		return 0;
+	
+	return !(c->toUpstream.shut && c->toClient.shut);
+}
+
+/*
+ * The proxy_pump() function moves data in one direction. Pending data is
+ * written first, then more is read, encrypted, and written, until either
+ * socket would block. When the source reaches end of file and everything
+ * has been written, the destination is shut down for writing.
+ * 
+ * Zero is returned upon any errors.
+ */
+static int proxy_pump(struct direction *d, int from, int to) {
+	int i, n;
+	
+	for (;;) {
+
+		// Write pending data
+		while (d->offset < d->length) {
+			if ((n = write(to, d->buffer + d->offset, d->length - d->offset)) == -1) {
+				if (errno == EINTR)
+					continue;
+				return errno == EAGAIN;
+			}
+			d->offset += n;
+		}
+		d->offset = d->length = 0;
+		
+		// Pass on end of file
+		if (d->eof) {
+			if (!d->shut) {
+				shutdown(to, SHUT_WR);
+				d->shut = 1;
+			}
+			return 1;
+		}
+		
+		// Read and encrypt more data
+		if ((n = read(from, d->buffer, PROXY_BUFFER_SIZE)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN;
+		}
+		if (n == 0)
+			d->eof = 1;
+		for (i = 0; i < n; ++i)
+			d->buffer[i] = mirrorfield_crypt_byte(&d->mf, d->buffer[i], 0);
+		d->length = n;
+	}
+}
+
+/*
+ * The proxy_close() function closes both sockets of a connection, which
+ * also removes them from the event loop, and marks it closed. The caller
+ * frees the connection.
+ */
+static void proxy_close(struct connection *c) {
+	close(c->client.fd);
+	close(c->upstream.fd);
+	c->closed = 1;
+}
@@ -0,0 +1,26 @@
+// Copyright (c) 2017 Brian Barto
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GPL License. See LICENSE for more details.
+
+#ifndef PROXY_H
+#define PROXY_H 1
+
+#include "modules/mirrorfield.h"
+
+/*
+ * Size in bytes of the buffer for each direction of a proxied connection.
+ */
+#define PROXY_BUFFER_SIZE      65536
+
+/*
+ * Maximum number of events handled per call to epoll_wait().
+ */
+#define PROXY_EVENTS           256
+
+/*
+ * Function Prototypes
+ */
+int  proxy_run(char *, char *, const struct mirrorfield *);
+
+#endif
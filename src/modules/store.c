@@ -0,0 +1,403 @@
+// Copyright (c) 2017 Brian Barto
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GPL License. See LICENSE for more details.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "main.h"
+#include "modules/mirrorfield.h"
+#include "modules/hash.h"
+#include "modules/store.h"
+
+/*
+ * MODULE DESCRIPTION
+ * 
+ * The store module is a small embedded key-value store for encrypted
+ * values. Records are appended to a single data file, which is memory
+ * mapped for reading, and a hash index in memory maps each key to its
+ * latest record. The index is rebuilt by scanning the file on open.
+ * 
+ * Each value is encrypted with a fresh mirror field cloned from the store
+ * key, so a value can be read with one lookup and one decrypt of its own
+ * length, without touching any other record. Keys are stored in the clear
+ * so the index can be rebuilt.
+ * 
+ * Writes are collected in a pending buffer and written to the file with a
+ * single write and fdatasync() when store_commit() is called or the
+ * buffer reaches STORE_BATCH_SIZE. Pending records can be read before
+ * they are committed.
+ * 
+ * The data file is a STORE_MAGIC header followed by batches, one per
+ * commit. Each batch is a STORE_BATCH_HEADER header, the records, and a
+ * STORE_COMMIT_MARKER. Each record is a STORE_RECORD_HEADER header, the
+ * key, and the encrypted value. A batch torn by a crash during a commit
+ * fails its checksum or lacks its marker, and is cut off on open along
+ * with anything after it.
+ */
+
+// Static Function Prototypes
+static int      store_map(struct store *);
+static long     store_batch(struct store *, long);
+static int      store_index_add(struct store *, uint32_t, long);
+static long     store_index_slot(struct store *, const char *, size_t, uint32_t);
+static unsigned char *store_record(struct store *, long);
+static uint32_t store_u32(const unsigned char *);
+
+/*
+ * The store_open() function opens the store data file at path, creating
+ * it if it does not exist, and builds the index. The file is truncated
+ * after the last valid batch, discarding anything left by an interrupted
+ * commit. The key must be loaded, validated, and linked, and must stay
+ * valid until the store is closed.
+ * 
+ * Upon any errors, NULL is returned.
+ */
+struct store *store_open(char *path, const struct mirrorfield *key) {
+	long offset, end, length;
+	unsigned char *record;
+	struct store *s;
+	
+	if ((s = calloc(1, sizeof(struct store))) == NULL)
+		return NULL;
+	s->key = key;
+	s->map = MAP_FAILED;
+	
+	if ((s->fd = open(path, O_RDWR | O_CREAT, 0600)) == -1) {
+		free(s);
+		return NULL;
+	}
+	
+	// Write the header to a new file
+	if (lseek(s->fd, 0, SEEK_END) == 0 && write(s->fd, STORE_MAGIC, STORE_MAGIC_SIZE) != STORE_MAGIC_SIZE) {
+		store_close(s);
+		return NULL;
+	}
+	
+	if (store_map(s) == 0 || s->mapSize < STORE_MAGIC_SIZE || memcmp(s->map, STORE_MAGIC, STORE_MAGIC_SIZE) != 0) {
+		store_close(s);
+		return NULL;
+	}
+	
+	// Index the records of all valid batches
+	for (offset = STORE_MAGIC_SIZE; (end = store_batch(s, offset)) != -1; offset = end) {
+		for (offset += STORE_BATCH_HEADER; offset < end - STORE_COMMIT_SIZE; offset += length) {
+			record = s->map + offset;
+			length = STORE_RECORD_HEADER + (long)store_u32(record) + (long)store_u32(record + 4);
+			if (store_index_add(s, hash_fnv1a(record + STORE_RECORD_HEADER, store_u32(record)), offset) == 0) {
+				store_close(s);
+				return NULL;
+			}
+		}
+	}
+	
+	// Discard a torn batch
+	if (offset < s->mapSize) {
+		if (ftruncate(s->fd, offset) == -1 || store_map(s) == 0) {
+			store_close(s);
+			return NULL;
+		}
+	}
+	
+	return s;
+}
+
+/*
+ * The store_put() function adds or replaces the value for a key. The
+ * value is encrypted in to the pending buffer and becomes durable when it
+ * is committed.
+ * 
+ * Zero is returned upon any errors.
+ */
+int store_put(struct store *s, const char *key, size_t keyLength, const unsigned char *value, size_t valueLength) {
+	size_t i;
+	long length = STORE_RECORD_HEADER + keyLength + valueLength;
+	long needed;
+	unsigned char *record;
+	struct mirrorfield mf;
+	
+	// The records of a batch must fit a 4 byte length
+	if (keyLength > UINT32_MAX || valueLength > UINT32_MAX || length > (long)UINT32_MAX - STORE_BATCH_HEADER - STORE_COMMIT_SIZE)
+		return 0;
+	if (s->pendingLength + length + STORE_COMMIT_SIZE > (long)UINT32_MAX)
+		if (store_commit(s) == 0)
+			return 0;
+	
+	// Start a new batch with room for its header
+	if (s->pendingLength == 0)
+		s->pendingLength = STORE_BATCH_HEADER;
+	
+	// Grow the pending buffer, leaving room for the commit marker
+	needed = s->pendingLength + length + STORE_COMMIT_SIZE;
+	if (needed > s->pendingSize) {
+		s->pendingSize = needed > STORE_BATCH_SIZE ? needed : STORE_BATCH_SIZE;
+		if ((record = realloc(s->pending, s->pendingSize)) == NULL)
+			return 0;
+		s->pending = record;
+	}
+	record = s->pending + s->pendingLength;
+	
+	// Record header and key
+	for (i = 0; i < 4; ++i) {
+		record[i] = (keyLength >> (i * 8)) & 0xFF;
+		record[i + 4] = (valueLength >> (i * 8)) & 0xFF;
+	}
+	memcpy(record + STORE_RECORD_HEADER, key, keyLength);
+	
+	// Encrypted value
+	mirrorfield_clone(&mf, s->key);
+	record += STORE_RECORD_HEADER + keyLength;
+	for (i = 0; i < valueLength; ++i)
+		record[i] = mirrorfield_crypt_byte(&mf, value[i], 0);
+	
+	if (store_index_add(s, hash_fnv1a(key, keyLength), s->mapSize + s->pendingLength) == 0)
+		return 0;
+	s->pendingLength += length;
+	
+	if (s->pendingLength >= STORE_BATCH_SIZE)
+		return store_commit(s);
+	
+	return 1;
+}
+
+/*
+ * The store_get() function decrypts the value for a key in to buf,
+ * copying at most size bytes. No memory is allocated.
+ * 
+ * Returns the full length of the value, which may be more than size, or
+ * -1 if the key is not in the store.
+ */
+long store_get(struct store *s, const char *key, size_t keyLength, unsigned char *buf, size_t size) {
+	size_t i, length;
+	long slot;
+	unsigned char *record;
+	struct mirrorfield mf;
+	
+	if (s->indexSize == 0)
+		return -1;
+	
+	slot = store_index_slot(s, key, keyLength, hash_fnv1a(key, keyLength));
+	if (s->index[slot].offset == 0)
+		return -1;
+	
+	record = store_record(s, s->index[slot].offset);
+	length = store_u32(record + 4);
+	record += STORE_RECORD_HEADER + keyLength;
+	
+	mirrorfield_clone(&mf, s->key);
+	for (i = 0; i < length && i < size; ++i)
+		buf[i] = mirrorfield_crypt_byte(&mf, record[i], 0);
+	
+	return length;
+}
+
+/*
+ * The store_commit() function writes all pending records to the data file
+ * as one batch, with its checksum and commit marker, waits for it to
+ * reach the disk, and maps it for reading.
+ * 
+ * Zero is returned upon any errors.
+ */
+int store_commit(struct store *s) {
+	int i;
+	long n, w;
+	uint32_t length, checksum;
+	
+	if (s->pendingLength == 0)
+		return 1;
+	
+	// Complete the batch header and add the commit marker
+	length = s->pendingLength - STORE_BATCH_HEADER;
+	checksum = hash_fnv1a(s->pending + STORE_BATCH_HEADER, length);
+	for (i = 0; i < 4; ++i) {
+		s->pending[i] = (length >> (i * 8)) & 0xFF;
+		s->pending[i + 4] = (checksum >> (i * 8)) & 0xFF;
+	}
+	memcpy(s->pending + s->pendingLength, STORE_COMMIT_MARKER, STORE_COMMIT_SIZE);
+	s->pendingLength += STORE_COMMIT_SIZE;
+	
+	// Write the batch at the end of the mapped data
+	for (n = 0; n < s->pendingLength; n += w) {
+		if ((w = pwrite(s->fd, s->pending + n, s->pendingLength - n, s->mapSize + n)) == -1) {
+			if (errno == EINTR) {
+				w = 0;
+				continue;
+			}
+			s->pendingLength -= STORE_COMMIT_SIZE;
+			return 0;
+		}
+	}
+	
+	if (fdatasync(s->fd) == -1) {
+		s->pendingLength -= STORE_COMMIT_SIZE;
+		return 0;
+	}
+	
+	s->pendingLength = 0;
+	
+	return store_map(s);
+}
+
+/*
+ * The store_close() function commits any pending records, closes the
+ * store, and frees the handle.
+ * 
+ * Zero is returned if the pending records could not be committed.
+ */
+int store_close(struct store *s) {
+	int r = 1;
+	
+	if (s->fd != -1 && s->pendingLength > 0)
+		r = store_commit(s);
+	
+	if (s->map != MAP_FAILED)
+		munmap(s->map, s->mapSize);
+	if (s->fd != -1)
+		close(s->fd);
+	free(s->pending);
+	free(s->index);
+	free(s);
+	
+	return r;
+}
+
+/*
+ * The store_map() function maps the whole data file for reading,
+ * replacing any previous mapping.
+ * 
+ * Zero is returned upon any errors.
+ */
+static int store_map(struct store *s) {
+	struct stat sb;
+	
+	if (s->map != MAP_FAILED)
+		munmap(s->map, s->mapSize);
+	s->map = MAP_FAILED;
+	s->mapSize = 0;
+	
+	if (fstat(s->fd, &sb) == -1)
+		return 0;
+	if (sb.st_size == 0)
+		return 1;
+	
+	if ((s->map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, s->fd, 0)) == MAP_FAILED)
+		return 0;
+	s->mapSize = sb.st_size;
+	
+	return 1;
+}
+
+/*
+ * The store_batch() function checks the batch at offset in the mapped
+ * file. A batch is valid if it is complete, ends with the commit marker,
+ * matches its checksum, and its records exactly fill it.
+ * 
+ * Returns the offset just past the batch, or -1 if it is not valid.
+ */
+static long store_batch(struct store *s, long offset) {
+	long end, length;
+	unsigned char *batch = s->map + offset;
+	
+	if (offset + STORE_BATCH_HEADER + STORE_COMMIT_SIZE > s->mapSize)
+		return -1;
+	
+	end = offset + STORE_BATCH_HEADER + (long)store_u32(batch) + STORE_COMMIT_SIZE;
+	if (end > s->mapSize || memcmp(s->map + end - STORE_COMMIT_SIZE, STORE_COMMIT_MARKER, STORE_COMMIT_SIZE) != 0)
+		return -1;
+	if (hash_fnv1a(batch + STORE_BATCH_HEADER, store_u32(batch)) != store_u32(batch + 4))
+		return -1;
+	
+	// Check the records exactly fill the batch
+	for (offset += STORE_BATCH_HEADER; offset + STORE_RECORD_HEADER <= end - STORE_COMMIT_SIZE; offset += length)
+		length = STORE_RECORD_HEADER + (long)store_u32(s->map + offset) + (long)store_u32(s->map + offset + 4);
+	if (offset != end - STORE_COMMIT_SIZE)
+		return -1;
+	
+	return end;
+}
+
+/*
+ * The store_index_add() function points the index entry for the key of
+ * the record at offset to that record, adding an entry if the key is new.
+ * The index doubles in size when it becomes half full.
+ * 
+ * Zero is returned if memory can not be allocated.
+ */
+static int store_index_add(struct store *s, uint32_t hash, long offset) {
+	long i, j, slot;
+	unsigned char *record = store_record(s, offset);
+	struct store_entry *old;
+
+	// Grow the index
+	if ((s->indexCount + 1) * 2 > s->indexSize) {
+		old = s->index;
+		if ((s->index = calloc(s->indexSize ? s->indexSize * 2 : STORE_INDEX_INITIAL, sizeof(struct store_entry))) == NULL) {
+			s->index = old;
+			return 0;
+		}
+		j = s->indexSize;
+		s->indexSize = j ? j * 2 : STORE_INDEX_INITIAL;
+		for (i = 0; i < j; ++i) {
+			if (old[i].offset == 0)
+				continue;
+			for (slot = old[i].hash % s->indexSize; s->index[slot].offset != 0; slot = (slot + 1) % s->indexSize)
+				;
+			s->index[slot] = old[i];
+		}
+		free(old);
+	}
+	
+	// Point the key at the record, adding it if it is new
+	slot = store_index_slot(s, (char *)record + STORE_RECORD_HEADER, store_u32(record), hash);
+	if (s->index[slot].offset == 0)
+		++s->indexCount;
+	s->index[slot].hash = hash;
+	s->index[slot].offset = offset;
+	
+	return 1;
+}
+
+/*
+ * The store_index_slot() function returns the index slot that holds a
+ * key, or the empty slot where it belongs.
+ */
+static long store_index_slot(struct store *s, const char *key, size_t keyLength, uint32_t hash) {
+	long i;
+	unsigned char *record;
+	
+	for (i = hash % s->indexSize; s->index[i].offset != 0; i = (i + 1) % s->indexSize) {
+		if (s->index[i].hash != hash)
+			continue;
+		record = store_record(s, s->index[i].offset);
+		if (store_u32(record) == keyLength && memcmp(record + STORE_RECORD_HEADER, key, keyLength) == 0)
+			break;
+	}
+	
+	return i;
+}
+
+/*
+ * The store_record() function returns a pointer to the record at offset,
+ * which is either in the mapped file or in the pending buffer.
+ */
+static unsigned char *store_record(struct store *s, long offset) {
+	if (offset < s->mapSize)
+		return s->map + offset;
+	else
+		return s->pending + (offset - s->mapSize);
+}
+
+/*
+ * The store_u32() function reads a 4 byte little endian value.
+ */
+static uint32_t store_u32(const unsigned char *p) {
+	return ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+}
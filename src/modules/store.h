@@ -0,0 +1,81 @@
+// Copyright (c) 2017 Brian Barto
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GPL License. See LICENSE for more details.
+
+#ifndef STORE_H
+#define STORE_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include "modules/mirrorfield.h"
+
+/*
+ * Magic string at the start of every store data file.
+ */
+#define STORE_MAGIC            "MRRSTOR2"
+#define STORE_MAGIC_SIZE       8
+
+/*
+ * Size in bytes of a batch header: the length of the records in the
+ * batch and their FNV-1a checksum, each stored as 4 little endian bytes.
+ */
+#define STORE_BATCH_HEADER     8
+
+/*
+ * Marker written after the records of every batch. A batch is only
+ * valid once its marker is on disk.
+ */
+#define STORE_COMMIT_MARKER    "MRRC"
+#define STORE_COMMIT_SIZE      4
+
+/*
+ * Size in bytes of a record header: the key length and the value length,
+ * each stored as 4 little endian bytes.
+ */
+#define STORE_RECORD_HEADER    8
+
+/*
+ * Pending writes are committed automatically once they reach this size.
+ */
+#define STORE_BATCH_SIZE       1048576
+
+/*
+ * Initial number of slots in the hash index.
+ */
+#define STORE_INDEX_INITIAL    1024
+
+/*
+ * Hash Index Entry Definition
+ */
+struct store_entry {
+	uint32_t hash;
+	long offset;
+};
+
+/*
+ * Store Handle Definition
+ */
+struct store {
+	int fd;
+	unsigned char *map;
+	long mapSize;
+	unsigned char *pending;
+	long pendingSize;
+	long pendingLength;
+	struct store_entry *index;
+	long indexSize;
+	long indexCount;
+	const struct mirrorfield *key;
+};
+
+/*
+ * Function Prototypes
+ */
+struct store *store_open(char *, const struct mirrorfield *);
+int   store_put(struct store *, const char *, size_t, const unsigned char *, size_t);
+long  store_get(struct store *, const char *, size_t, unsigned char *, size_t);
+int   store_commit(struct store *);
+int   store_close(struct store *);
+
+#endif
@@ -0,0 +1,104 @@
+// Copyright (c) 2017 Brian Barto
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GPL License. See LICENSE for more details.
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "modules/profile.h"
+#include "modules/workers.h"
+
+/*
+ * MODULE DESCRIPTION
+ * 
+ * The workers module runs a pool of forked worker processes. Each worker
+ * is connected to the parent by a command pipe and a result pipe. What
+ * is sent on the pipes is up to the caller, which usually shares its
+ * data with the workers through a MAP_SHARED mapping created before the
+ * pool is started.
+ */
+
+/*
+ * The workers_start() function forks count worker processes. Worker i
+ * runs work(i, cmd, result) with the read end of its command pipe and
+ * the write end of its result pipe, and exits when it returns. The
+ * worker inherits a copy of everything the caller set up before the
+ * call.
+ * 
+ * Zero is returned if a worker could not be started, in which case the
+ * workers that did start are stopped.
+ */
+int workers_start(struct workers *w, int count, void (*work)(int, int, int)) {
+	int i, j;
+	int cmd[2], result[2];
+	
+	if (count > WORKERS_MAX)
+		return 0;
+	
+	for (w->count = 0; w->count < count; ++w->count) {
+		i = w->count;
+		if (pipe(cmd) == -1)
+			break;
+		if (pipe(result) == -1) {
+			close(cmd[0]);
+			close(cmd[1]);
+			break;
+		}
+		
+		if ((w->pids[i] = fork()) == -1) {
+			close(cmd[0]);
+			close(cmd[1]);
+			close(result[0]);
+			close(result[1]);
+			break;
+		}
+
+		if (w->pids[i] == 0) {
+			profile_fork();
+
+			// Close the parent's ends of the earlier workers' pipes
+			for (j = 0; j < i; ++j) {
+				close(w->cmds[j]);
+				close(w->results[j]);
+			}
+			close(cmd[1]);
+			close(result[0]);
+			
+			work(i, cmd[0], result[1]);
+			
+			profile_stop();
+			_exit(0);
+		}
+		
+		close(cmd[0]);
+		close(result[1]);
+		w->cmds[i] = cmd[1];
+		w->results[i] = result[0];
+	}
+	
+	if (w->count == count)
+		return 1;
+	
+	workers_stop(w);
+	
+	return 0;
+}
+
+/*
+ * The workers_stop() function closes the pipes of every worker, which
+ * tells it to exit, and waits for it.
+ */
+void workers_stop(struct workers *w) {
+	int i;
+	
+	for (i = 0; i < w->count; ++i) {
+		close(w->cmds[i]);
+		close(w->results[i]);
+	}
+	for (i = 0; i < w->count; ++i)
+		waitpid(w->pids[i], NULL, 0);
+	
+	w->count = 0;
+}
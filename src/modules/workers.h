@@ -0,0 +1,35 @@
+// Copyright (c) 2017 Brian Barto
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GPL License. See LICENSE for more details.
+
+#ifndef WORKERS_H
+#define WORKERS_H 1
+
+#include <sys/types.h>
+
+/*
+ * Maximum number of worker processes in a pool.
+ */
+#define WORKERS_MAX 64
+
+/*
+ * Worker Pool Definition
+ * 
+ * The parent writes commands for worker i to cmds[i] and reads its
+ * results from results[i].
+ */
+struct workers {
+	int count;
+	pid_t pids[WORKERS_MAX];
+	int cmds[WORKERS_MAX];
+	int results[WORKERS_MAX];
+};
+
+/*
+ * Function Prototypes
+ */
+int  workers_start(struct workers *, int, void (*)(int, int, int));
+void workers_stop(struct workers *);
+
+#endif
@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+#include "main.h"
+#include "modules/keyfile.h"
+#include "modules/mirrorfield.h"
+#include "modules/hash.h"
+
+/*
+ * The replay program regenerates recorded encryption traffic against the
+ * mirrorfield module and reports throughput and latency percentiles.
+ * 
+ * The trace is read from the file given with -t, or from STDIN, and has
+ * one message per line:
+ * 
+ *     <stream id> <message size> <gap in microseconds>
+ * 
+ * The gap is the time since the previous message in the trace. Each new
+ * stream id gets its own mirror field cloned from the key, and a message
+ * size of zero closes the stream. Lines starting with '#' are ignored.
+ * Traces carry only the shape of the traffic, never payloads. Messages
+ * are filled with generated bytes.
+ * 
+ * Gaps are divided by the speed given with -s, so -s 10 replays ten times
+ * faster than recorded. A speed of zero ignores the gaps entirely. The
+ * latency of a message is measured from its scheduled arrival time, so
+ * it includes any time spent queued behind earlier messages.
+ * 
+ * Stream ids can be any unsigned number, such as hashed connection ids.
+ * Open streams are found through a hash table keyed on the id.
+ */
+
+/*
+ * Initial number of slots in the stream table.
+ */
+#define STREAMS_INITIAL 1024
+
+/*
+ * Stream Table Entry Definition. An entry with a NULL field is empty.
+ */
+struct stream {
+	unsigned long id;
+	struct mirrorfield *field;
+};
+
+int load_key(struct mirrorfield *, char *);
+struct stream *stream_slot(struct stream *, long, unsigned long);
+int stream_grow(struct stream **, long *);
+void stream_remove(struct stream *, long, struct stream *);
+double now(void);
+int compare_double(const void *, const void *);
+
+int main(int argc, char *argv[]) {
+	int o, i;
+	int size, gap;
+	int maxSize = 0;
+	unsigned long id;
+	long messages = 0, latencyMax = 1024;
+	long streamSize = STREAMS_INITIAL, streamCount = 0;
+	double speed = 1, start, arrival = 0, done, bytes = 0;
+	double *latency = malloc(latencyMax * sizeof(double)), *grownLatency;
+	char *keyFileName = NULL;
+	char line[256];
+	unsigned char *payload = NULL, *grown;
+	FILE *trace = stdin;
+	struct mirrorfield key;
+	struct stream *streams = calloc(streamSize, sizeof(struct stream));
+	struct stream *stream;
+	struct timespec ts;
+	
+	if (latency == NULL || streams == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+	
+	keyfile_init();
+
+	// Check arguments
+	while ((o = getopt(argc, argv, "k:t:s:")) != -1) {
+		switch (o) {
+			case 'k':
+				keyFileName = optarg;
+				break;
+			case 't':
+				if ((trace = fopen(optarg, "r")) == NULL) {
+					fprintf(stderr, "Could not open trace file.\n");
+					return 1;
+				}
+				break;
+			case 's':
+				speed = atof(optarg);
+				break;
+			case '?':
+				if (isprint(optopt))
+					fprintf (stderr, "Unknown option '-%c'.\n", optopt);
+				else
+					fprintf (stderr, "Unknown option character '\\x%x'.\n", optopt);
+				return 1;
+		}
+	}
+	
+	if (keyFileName == NULL || load_key(&key, keyFileName) == 0) {
+		fprintf(stderr, "A valid key file must be given with -k.\n");
+		return 1;
+	}
+	
+	start = now();
+
+	// Replay each message in the trace
+	while (fgets(line, sizeof(line), trace) != NULL) {
+		if (line[0] == '#' || sscanf(line, "%lu %d %d", &id, &size, &gap) != 3 || size < 0)
+			continue;
+		
+		// Wait for the scheduled arrival time
+		if (speed > 0) {
+			arrival += gap / 1000000.0 / speed;
+			if (arrival > now() - start) {
+				done = arrival - (now() - start);
+				ts.tv_sec = (time_t)done;
+				ts.tv_nsec = (long)((done - ts.tv_sec) * 1000000000);
+				nanosleep(&ts, NULL);
+			}
+		} else {
+			arrival = now() - start;
+		}
+
+		stream = stream_slot(streams, streamSize, id);
+
+		// Close the stream
+		if (size == 0) {
+			if (stream->field != NULL) {
+				free(stream->field);
+				stream_remove(streams, streamSize, stream);
+				--streamCount;
+			}
+			continue;
+		}
+		
+		// Open the stream, growing the table first if it is half full
+		if (stream->field == NULL) {
+			if ((streamCount + 1) * 2 > streamSize) {
+				if (stream_grow(&streams, &streamSize) == 0) {
+					fprintf(stderr, "Out of memory.\n");
+					return 1;
+				}
+				stream = stream_slot(streams, streamSize, id);
+			}
+			if ((stream->field = malloc(sizeof(struct mirrorfield))) == NULL) {
+				fprintf(stderr, "Out of memory.\n");
+				return 1;
+			}
+			stream->id = id;
+			mirrorfield_clone(stream->field, &key);
+			++streamCount;
+		}
+		
+		// Generate the payload
+		if (size > maxSize) {
+			if ((grown = realloc(payload, size)) == NULL) {
+				fprintf(stderr, "Out of memory.\n");
+				return 1;
+			}
+			payload = grown;
+			for (i = maxSize; i < size; ++i)
+				payload[i] = rand();
+			maxSize = size;
+		}
+		
+		// Encrypt the message
+		for (i = 0; i < size; ++i)
+			payload[i] = mirrorfield_crypt_byte(stream->field, payload[i], 0);
+		
+		// Record latency
+		done = now() - start;
+		if (messages == latencyMax) {
+			if ((grownLatency = realloc(latency, latencyMax * 2 * sizeof(double))) == NULL) {
+				fprintf(stderr, "Out of memory.\n");
+				return 1;
+			}
+			latencyMax *= 2;
+			latency = grownLatency;
+		}
+		latency[messages++] = done - arrival;
+		bytes += size;
+	}
+	
+	done = now() - start;
+
+	if (messages == 0) {
+		fprintf(stderr, "No messages in trace.\n");
+		return 1;
+	}
+
+	qsort(latency, messages, sizeof(double), compare_double);
+	
+	printf("messages:    %ld\n", messages);
+	printf("bytes:       %.0f\n", bytes);
+	printf("elapsed:     %.3f s\n", done);
+	printf("throughput:  %.2f MB/s, %.0f msg/s\n", bytes / done / 1000000, messages / done);
+	printf("latency p50: %.0f us\n", latency[messages * 50 / 100] * 1000000);
+	printf("latency p90: %.0f us\n", latency[messages * 90 / 100] * 1000000);
+	printf("latency p99: %.0f us\n", latency[messages * 99 / 100] * 1000000);
+	printf("latency max: %.0f us\n", latency[messages - 1] * 1000000);
+
+	return 0;
+}
+
+int load_key(struct mirrorfield *mf, char *keyFileName) {
+	int ch;
+	
+	mirrorfield_init(mf);
+
+	if (keyfile_open(keyFileName, 0) == 0)
+		return 0;
+	
+	while ((ch = keyfile_next_char()) != EOF)
+		if ((mirrorfield_set(mf, (unsigned char)ch)) == 0)
+			break;
+
+	keyfile_close();
+	
+	if (mirrorfield_validate(mf) == 0)
+		return 0;
+
+	mirrorfield_link(mf);
+	
+	return 1;
+}
+
+/*
+ * Returns the slot of the stream table that holds the given id, or the
+ * empty slot where it belongs. The table is open addressed with linear
+ * probing on the FNV-1a hash of the id.
+ */
+struct stream *stream_slot(struct stream *streams, long size, unsigned long id) {
+	long slot;
+	
+	for (slot = hash_fnv1a(&id, sizeof(id)) & (size - 1); streams[slot].field != NULL; slot = (slot + 1) & (size - 1))
+		if (streams[slot].id == id)
+			break;
+	
+	return &streams[slot];
+}
+
+/*
+ * Doubles the size of the stream table and re-inserts every open stream.
+ * Returns zero if the new table could not be allocated.
+ */
+int stream_grow(struct stream **streams, long *size) {
+	long i;
+	struct stream *grown = calloc(*size * 2, sizeof(struct stream));
+	
+	if (grown == NULL)
+		return 0;
+	
+	for (i = 0; i < *size; ++i)
+		if ((*streams)[i].field != NULL)
+			*stream_slot(grown, *size * 2, (*streams)[i].id) = (*streams)[i];
+	
+	free(*streams);
+	*streams = grown;
+	*size *= 2;
+	
+	return 1;
+}
+
+/*
+ * Empties a slot of the stream table. Entries later in the same probe run
+ * are shifted back so that every open stream is still found from its home
+ * slot.
+ */
+void stream_remove(struct stream *streams, long size, struct stream *stream) {
+	long hole = stream - streams;
+	long slot, home;
+	
+	streams[hole].field = NULL;
+
+	for (slot = (hole + 1) & (size - 1); streams[slot].field != NULL; slot = (slot + 1) & (size - 1)) {
+		// The lookup stops at the hole only if it lies on the entry's probe run
+		home = stream_slot(streams, size, streams[slot].id) - streams;
+		if (home == slot)
+			continue;
+		streams[hole] = streams[slot];
+		streams[slot].field = NULL;
+		hole = slot;
+	}
+}
+
+double now(void) {
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+int compare_double(const void *a, const void *b) {
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	
+	return (x > y) - (x < y);
+}
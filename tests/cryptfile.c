@@ -0,0 +1,105 @@
+// Copyright (c) 2017 Brian Barto
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GPL License. See LICENSE for more details.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "modules/keyfile.h"
+#include "modules/mirrorfield.h"
+#include "modules/cryptfile.h"
+
+/*
+ * Checks that cryptfile reads only the part of a file that existed when
+ * it was opened, after data is appended to it. The file is opened part
+ * way through its last block and the append fills that block, so reading
+ * it must not record a checkpoint past the ones allocated at open.
+ */
+
+#define BLOCKS 2
+#define APPEND CRYPTFILE_BLOCK_SIZE
+
+int main(void) {
+	int i;
+	long n;
+	char path[] = "/tmp/mrrcrypt-test-XXXXXX";
+	unsigned char key[KEYFILE_KEY_SIZE];
+	unsigned char *plain, *crypt, *buf;
+	long size = (BLOCKS * CRYPTFILE_BLOCK_SIZE) + (CRYPTFILE_BLOCK_SIZE / 2);
+	struct mirrorfield mf, key_mf;
+	struct cryptfile *h;
+	FILE *f;
+	int fd;
+
+	plain = malloc(size + APPEND);
+	crypt = malloc(size + APPEND);
+	buf = malloc(size + APPEND);
+	if (plain == NULL || crypt == NULL || buf == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	// Build a random key
+	if (keyfile_generate(key) == 0) {
+		fprintf(stderr, "Could not generate key.\n");
+		return 1;
+	}
+	mirrorfield_init(&key_mf);
+	for (i = 0; i < KEYFILE_KEY_SIZE; ++i)
+		mirrorfield_set(&key_mf, key[i]);
+	if (mirrorfield_validate(&key_mf) == 0) {
+		fprintf(stderr, "Invalid key.\n");
+		return 1;
+	}
+	mirrorfield_link(&key_mf);
+
+	// Encrypt the whole stream, including what will be appended later
+	for (i = 0; i < size + APPEND; ++i)
+		plain[i] = rand() & 0xFF;
+	mirrorfield_clone(&mf, &key_mf);
+	for (i = 0; i < size + APPEND; ++i)
+		crypt[i] = mirrorfield_crypt_byte(&mf, plain[i], 0);
+
+	// Write the first blocks and open the file
+	if ((fd = mkstemp(path)) == -1 || (f = fdopen(fd, "w")) == NULL) {
+		fprintf(stderr, "Could not create %s.\n", path);
+		return 1;
+	}
+	fwrite(crypt, 1, size, f);
+	fflush(f);
+	if ((h = cryptfile_open(path, &key_mf)) == NULL) {
+		fprintf(stderr, "Could not open %s.\n", path);
+		return 1;
+	}
+
+	// Append to the file, then read the tail
+	fwrite(crypt + size, 1, APPEND, f);
+	fclose(f);
+	n = cryptfile_pread(h, buf, CRYPTFILE_BLOCK_SIZE, size - 100);
+	if (n != 100 || memcmp(buf, plain + size - 100, n) != 0) {
+		fprintf(stderr, "FAIL: tail read returned %ld bytes.\n", n);
+		return 1;
+	}
+	if ((n = cryptfile_pread(h, buf, APPEND, size)) != 0) {
+		fprintf(stderr, "FAIL: read past the opened size returned %ld bytes.\n", n);
+		return 1;
+	}
+	n = cryptfile_pread(h, buf, size + APPEND, 0);
+	if (n != size || memcmp(buf, plain, n) != 0) {
+		fprintf(stderr, "FAIL: full read returned %ld bytes.\n", n);
+		return 1;
+	}
+
+	cryptfile_close(h);
+	unlink(path);
+	free(plain);
+	free(crypt);
+	free(buf);
+
+	printf("PASS: cryptfile\n");
+	return 0;
+}